@@ -0,0 +1,194 @@
+/*
+ * EPG database as written by octoscan --epgdb=<file>
+ *
+ * One file, mapped read-only by its readers and used in place:
+ *
+ *   header | services | events | strings
+ *
+ * Services are sorted by (onid, tsid, sid), the events of a service
+ * follow each other sorted by start time. Texts are UTF-8, interned
+ * per service into the string section and referenced by offset, 0 is
+ * the empty string. All fields are in host byte order.
+ *
+ * The writer never changes a file that is out there. It writes the
+ * next generation to <file>.tmp and renames it over <file>, so an open
+ * mapping stays consistent; a reader that wants the new data reopens
+ * the file when its modification time changes.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EPGDB_MAGIC "OCTOEPG\n"
+#define EPGDB_VERSION 1
+
+struct epgdb_header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t generation;	/* counts up with every write */
+	int64_t  written;	/* s since the epoch */
+	uint32_t nservices;
+	uint32_t nevents;
+	uint64_t services;	/* file offsets of the sections */
+	uint64_t events;
+	uint64_t strings;
+	uint64_t strings_len;
+};
+
+struct epgdb_service {
+	uint16_t onid;
+	uint16_t tsid;
+	uint16_t sid;
+	uint16_t pad;
+	uint32_t name;
+	uint32_t first;		/* index of its first event */
+	uint32_t count;
+	uint32_t pad2;
+};
+
+struct epgdb_event {
+	int64_t  start;		/* s since the epoch */
+	uint32_t duration;	/* s */
+	uint32_t title;
+	uint32_t text;
+	uint16_t event_id;
+	uint8_t  table_id;
+	uint8_t  content;	/* first content_nibble pair, 0 if none */
+	char     lang[3];
+	uint8_t  pad[5];
+};
+
+struct epgdb {
+	const uint8_t *map;
+	size_t size;
+	const struct epgdb_header *hdr;
+	const struct epgdb_service *svc;
+	const struct epgdb_event *ev;
+	const char *str;
+};
+
+static inline void epgdb_close(struct epgdb *db)
+{
+	if (db->map)
+		munmap((void *) db->map, db->size);
+	memset(db, 0, sizeof(*db));
+}
+
+/* map and check a database, 0 or -1 with errno set */
+static inline int epgdb_open(struct epgdb *db, const char *path)
+{
+	const struct epgdb_header *h;
+	struct stat st;
+	uint32_t i;
+	int fd;
+
+	memset(db, 0, sizeof(*db));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < (off_t) sizeof(*h)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	db->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (db->map == MAP_FAILED) {
+		db->map = NULL;
+		return -1;
+	}
+	db->size = st.st_size;
+	db->hdr = h = (const struct epgdb_header *) db->map;
+	if (memcmp(h->magic, EPGDB_MAGIC, 8) || h->version != EPGDB_VERSION ||
+	    h->services > db->size ||
+	    h->nservices > (db->size - h->services) / sizeof(struct epgdb_service) ||
+	    h->events > db->size ||
+	    h->nevents > (db->size - h->events) / sizeof(struct epgdb_event) ||
+	    h->strings > db->size || !h->strings_len ||
+	    h->strings_len > db->size - h->strings ||
+	    (h->services | h->events) % 8)
+		goto bad;
+	db->svc = (const struct epgdb_service *) (db->map + h->services);
+	db->ev = (const struct epgdb_event *) (db->map + h->events);
+	db->str = (const char *) (db->map + h->strings);
+	if (db->str[h->strings_len - 1])
+		goto bad;
+	for (i = 0; i < h->nservices; i++)
+		if (db->svc[i].first > h->nevents ||
+		    db->svc[i].count > h->nevents - db->svc[i].first)
+			goto bad;
+	return 0;
+bad:
+	epgdb_close(db);
+	errno = EINVAL;
+	return -1;
+}
+
+static inline const char *epgdb_str(const struct epgdb *db, uint32_t off)
+{
+	return off < db->hdr->strings_len ? db->str + off : "";
+}
+
+static inline const struct epgdb_service *
+epgdb_service(const struct epgdb *db, uint16_t onid, uint16_t tsid, uint16_t sid)
+{
+	uint64_t key = (uint64_t) onid << 32 | (uint32_t) tsid << 16 | sid, k;
+	uint32_t lo = 0, hi = db->hdr->nservices, mid;
+	const struct epgdb_service *s;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		s = &db->svc[mid];
+		k = (uint64_t) s->onid << 32 | (uint32_t) s->tsid << 16 | s->sid;
+		if (k == key)
+			return s;
+		if (k < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static inline const struct epgdb_event *
+epgdb_end(const struct epgdb *db, const struct epgdb_service *s)
+{
+	return db->ev + s->first + s->count;
+}
+
+/* first event of s that starts after t, the one before may be running */
+static inline const struct epgdb_event *
+epgdb_after(const struct epgdb *db, const struct epgdb_service *s, int64_t t)
+{
+	const struct epgdb_event *ev = db->ev + s->first;
+	uint32_t lo = 0, hi = s->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ev[mid].start <= t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return ev + lo;
+}
+
+/* the event of s running at t, NULL if none */
+static inline const struct epgdb_event *
+epgdb_at(const struct epgdb *db, const struct epgdb_service *s, int64_t t)
+{
+	const struct epgdb_event *e = epgdb_after(db, s, t);
+
+	if (e == db->ev + s->first || e[-1].start + e[-1].duration <= t)
+		return NULL;
+	return e - 1;
+}
@@ -0,0 +1,207 @@
+/*
+ * epgquery: now/next and "what's on at" lookups in an octoscan EPG
+ * database (--epgdb), see epgdb.h.
+ *
+ * epgquery <db> [-t <time>] [<onid>.<tsid>.<sid> ...]
+ *	events running at and following <time> (default: now) on the
+ *	given services, or on all of them
+ * epgquery <db> -l
+ *	list the services
+ * epgquery <db> -b [<lookups>]
+ *	lookup latency benchmark with random services and times
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "epgdb.h"
+
+static int64_t nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* seconds since the epoch, or HH:MM today in local time */
+static int parse_time(const char *arg, int64_t *t)
+{
+	struct tm tm;
+	time_t now = time(NULL);
+	unsigned int h, m;
+	char *end;
+
+	if (sscanf(arg, "%u:%u", &h, &m) == 2 && h < 24 && m < 60) {
+		localtime_r(&now, &tm);
+		tm.tm_hour = h;
+		tm.tm_min = m;
+		tm.tm_sec = 0;
+		*t = mktime(&tm);
+		return 0;
+	}
+	*t = strtoll(arg, &end, 10);
+	return *end || end == arg ? -1 : 0;
+}
+
+static void print_event(const struct epgdb *db, const char *what,
+			const struct epgdb_event *e)
+{
+	char from[16], to[16];
+	time_t t;
+	struct tm tm;
+
+	t = e->start;
+	strftime(from, sizeof(from), "%H:%M", localtime_r(&t, &tm));
+	t = e->start + e->duration;
+	strftime(to, sizeof(to), "%H:%M", localtime_r(&t, &tm));
+	printf("  %-4s %s-%s %s\n", what, from, to, epgdb_str(db, e->title));
+}
+
+static void print_service(const struct epgdb *db, const struct epgdb_service *s,
+			  int64_t t)
+{
+	const struct epgdb_event *e = epgdb_after(db, s, t);
+
+	printf("%u.%u.%u %s\n", s->onid, s->tsid, s->sid, epgdb_str(db, s->name));
+	if (e > db->ev + s->first && e[-1].start + e[-1].duration > t)
+		print_event(db, "now", e - 1);
+	if (e < epgdb_end(db, s))
+		print_event(db, "next", e);
+}
+
+static void bench(const char *path, const struct epgdb *db, int lookups)
+{
+	const struct epgdb_service *s, *all = db->svc;
+	const struct epgdb_event *e;
+	uint32_t n = db->hdr->nservices, *pick;
+	int64_t tmin = INT64_MAX, tmax = INT64_MIN, *at, t0, found = 0;
+	struct epgdb ndb;
+	uint32_t i;
+	int k, reps = 100;
+
+	if (!n || !db->hdr->nevents || lookups < 1) {
+		fprintf(stderr, "no events to look up\n");
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (!all[i].count)
+			continue;
+		e = db->ev + all[i].first;
+		if (e->start < tmin)
+			tmin = e->start;
+		e += all[i].count - 1;
+		if (e->start + e->duration > tmax)
+			tmax = e->start + e->duration;
+	}
+	pick = malloc(lookups * sizeof(*pick));
+	at = malloc(lookups * sizeof(*at));
+	if (!pick || !at)
+		return;
+	srandom(1);
+	for (k = 0; k < lookups; k++) {
+		pick[k] = random() % n;
+		at[k] = tmin + random() % (tmax - tmin + 1);
+	}
+
+	t0 = nsecs();
+	for (k = 0; k < reps; k++) {
+		if (epgdb_open(&ndb, path) < 0)
+			break;
+		epgdb_close(&ndb);
+	}
+	if (k == reps)
+		printf("open and check: %.1f us\n", (nsecs() - t0) / 1000.0 / reps);
+
+	t0 = nsecs();
+	for (k = 0; k < lookups; k++) {
+		s = epgdb_service(db, all[pick[k]].onid, all[pick[k]].tsid, all[pick[k]].sid);
+		if (s && epgdb_at(db, s, at[k]))
+			found++;
+	}
+	t0 = nsecs() - t0;
+	printf("service + event at time: %d lookups, %lld running, %.1f ns per lookup\n",
+	       lookups, (long long) found, (double) t0 / lookups);
+
+	t0 = nsecs();
+	found = 0;
+	for (k = 0; k < reps; k++)
+		for (i = 0; i < n; i++)
+			if (epgdb_at(db, &all[i], at[k % lookups]))
+				found++;
+	t0 = nsecs() - t0;
+	printf("all %u services at one time: %.1f us per query, %lld running\n", n,
+	       (double) t0 / 1000 / reps, (long long) found / reps);
+	free(pick);
+	free(at);
+}
+
+static void usage(void)
+{
+	printf("epgquery <db> [-t <time>] [<onid>.<tsid>.<sid> ...]\n");
+	printf("    events running at and following time (default: now),\n");
+	printf("    time = seconds since the epoch or HH:MM today\n");
+	printf("epgquery <db> -l\n");
+	printf("    list the services\n");
+	printf("epgquery <db> -b [<lookups>]\n");
+	printf("    lookup latency benchmark\n");
+}
+
+int main(int argc, char **argv)
+{
+	const struct epgdb_service *s;
+	struct epgdb db;
+	int64_t t = time(NULL);
+	unsigned int onid, tsid, sid;
+	uint32_t i;
+	int a = 2, shown = 0;
+
+	if (argc < 2) {
+		usage();
+		return 0;
+	}
+	if (epgdb_open(&db, argv[1]) < 0) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return -1;
+	}
+	if (a < argc && !strcmp(argv[a], "-l")) {
+		printf("generation %u, %u services, %u events\n", db.hdr->generation,
+		       db.hdr->nservices, db.hdr->nevents);
+		for (i = 0; i < db.hdr->nservices; i++)
+			printf("%u.%u.%u %s: %u events\n", db.svc[i].onid, db.svc[i].tsid,
+			       db.svc[i].sid, epgdb_str(&db, db.svc[i].name), db.svc[i].count);
+		return 0;
+	}
+	if (a < argc && !strcmp(argv[a], "-b")) {
+		bench(argv[1], &db, a + 1 < argc ? atoi(argv[a + 1]) : 1000000);
+		return 0;
+	}
+	if (a + 1 < argc && !strcmp(argv[a], "-t")) {
+		if (parse_time(argv[a + 1], &t) < 0) {
+			fprintf(stderr, "bad time %s\n", argv[a + 1]);
+			return -1;
+		}
+		a += 2;
+	}
+	for (; a < argc; a++) {
+		if (sscanf(argv[a], "%u.%u.%u", &onid, &tsid, &sid) != 3) {
+			usage();
+			return -1;
+		}
+		s = epgdb_service(&db, onid, tsid, sid);
+		if (!s)
+			printf("%s: no such service\n", argv[a]);
+		else
+			print_service(&db, s, t);
+		shown++;
+	}
+	if (!shown)
+		for (i = 0; i < db.hdr->nservices; i++)
+			print_service(&db, &db.svc[i], t);
+	epgdb_close(&db);
+	return 0;
+}
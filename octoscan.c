@@ -19,12 +19,15 @@
 	03/2020 M3U Playlist creation function added gompf01/github
 */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>
 #include <stddef.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -33,9 +36,11 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 #include <signal.h>
 #include <dirent.h>
-#include <pthread.h>
 #include <ifaddrs.h>
 
 #include <fcntl.h>
@@ -49,11 +54,20 @@
 #include <net/if_arp.h>
 #include <time.h>
 #include <ctype.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(CRC_PMULL)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 
 #define container_of(p, st, field) (st*)((char*)(p) - offsetof(st, field))
 
 #include "list.h"
+#include "epgdb.h"
 
 #include <getopt.h>
 
@@ -68,7 +82,30 @@ time_t mtime(time_t *t)
 	return ts.tv_sec;
 }
 
+static int64_t mtime_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts))
+		return 0;
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static int done = 0;
+static int tuners = 1;
+static int rtp_rcvbuf = 4096 * 1024;
+static int keep_session = 0;
+static int http_pids_all = 0;	/* --http_all */
+static int lock_wait = 1500;	/* ms to wait for an RTCP lock report, 0 = off */
+static int daemon_dwell = 0;	/* --daemon: s on a transponder while others wait */
+
+#define DAEMON_RETRY_MS 10000	/* after a server failed a session */
+#define DAEMON_STATS_MS 60000
+
+enum { RX_RECVMMSG, RX_URING };
+static int rx_backend = RX_RECVMMSG;
+enum { EPG_NONE, EPG_XMLTV, EPG_JSONL };
+static int epg_fmt = EPG_NONE;	/* --epg */
 static int eit_size = 0;
 static int eit_services = 0;
 static int eit_sections = 0;
@@ -76,6 +113,10 @@ static int eit_events = 0;
 static int eit_shortsize = 0;
 static int eit_extsize = 0;
 static int eit_events_deleted = 0;
+static int eit_events_updated = 0;
+static int eit_allocs = 0;	/* event store growth */
+static uint32_t eit_changes = 0;	/* event store updates, for --epgdb */
+static int sec_inplace = 1;	/* parse single packet sections in place */
 
 char *pol2str[] = {"v", "h", "r", "l"};
 char *msys2str[] = {"undef", "dvbc", "dvbcb", "dvbt", "dss", "dvbs", "dvbs2", "dvbh",
@@ -102,6 +143,7 @@ struct sfilter {
 	struct pid_info *pidi;
 	struct list_head link;
 	struct list_head tslink;
+	struct sfilter *hnext;	/* pid_info.sfh chain */
 
 	uint8_t  tid;
 	uint16_t  ext;
@@ -110,31 +152,74 @@ struct sfilter {
 
 	uint8_t vnr;
 	unsigned int todo_set : 1;
-	unsigned int done : 1;
 	unsigned int use_ext : 2;
 	unsigned int vnr_set : 1;
+	unsigned int kept : 1;		/* complete EIT filter left running, --daemon */
 	uint32_t todo[8];
 
-	time_t   timeout;
-	uint32_t timeout_len;
+	int64_t  timeout;	/* mtime_ms() deadline */
+	uint32_t timeout_len;	/* seconds, upper bound */
+	int64_t  start;		/* waiting for data since */
+	unsigned int seen : 1;
+	int      hidx;		/* index in ts_info.heap, -1 if done */
+};
+
+/*
+ * Section 0 arrivals of one table_id on a PID. Many tables can share
+ * the table_id (one EIT per service), so the first table seen stands
+ * for all of them and its repetitions give the period samples.
+ */
+struct tseen {
+	uint8_t  tid;
+	uint16_t ext;		/* of the reference table */
+	uint32_t t;		/* mtime_ms(), truncated */
 };
 
 struct pid_info {
 	struct list_head link;
 	struct ts_info *tsi;
 	struct list_head sfilters;
+	struct sfilter **sfh;	/* sfilters hashed on (tid, ext) */
+	uint16_t sfh_size;	/* power of 2 */
+	uint16_t nsf;
 
 	uint16_t pid;
 	int      add_ext;
 	int      done;
 
-        uint8_t  used;
+        uint8_t  active;	/* wanted from the server */
+        uint8_t  sent;		/* last PID set sent to the server */
         uint8_t  cc;
 	uint16_t bufp;
 	uint16_t len;
-	uint8_t *buf;
+	uint16_t bufsize;
+	uint8_t  skip;		/* section dropped on its header, not copied */
+	uint8_t *buf;		/* from secbuf_get() */
+
+	struct tseen *seen;	/* per table_id on this PID */
+	uint8_t  nseen;
+	uint8_t  seensize;
+};
+
+/* epoll registration, data.ptr of every watched fd points at one of these */
+struct evsrc {
+	void (*handler)(struct evsrc *ev, uint32_t events);
 };
 
+enum rtsp_state {
+	RTSP_IDLE,
+	RTSP_CONNECT,
+	RTSP_SETUP,
+	RTSP_PLAY,
+	RTSP_RUNNING,
+	RTSP_TEARDOWN,
+};
+
+#define RTSP_TIMEOUT 5000
+
+#define RTP_BATCH 64	/* datagrams per recvmmsg() */
+#define RTP_SLOT  2048	/* receive buffer per datagram */
+
 struct satipcon {
 	char *host;
 	char *port;
@@ -143,28 +228,106 @@ struct satipcon {
 	uint32_t strid;
 	int seq;
 	int sock;
-	int usock;
+	int usock;		/* -1 with tcp */
+	int csock;		/* RTCP on nsport + 1, -1 if none */
 	int nsport;
+	int tcp;		/* RTP interleaved on the RTSP connection */
+	int http;		/* HTTP streaming, TS follows the reply */
+
+	enum rtsp_state state;
+	int pending;		/* requests not answered yet */
+	int stale;		/* replies still due for the previous tune */
+	int error;
+	int64_t deadline;	/* for the current step before RUNNING */
+	uint32_t evmask;
+	int rlen;
+	int wlen;
+	char rbuf[16384];	/* replies and interleaved RTP */
+	char wbuf[8192];
 };
 
+#define PID_LEAF 64
+
 struct ts_info {
-	struct list_head pids;
+	struct list_head pids;	/* all pid_info of pidmap */
 	struct list_head sfilters;
 
 	struct scantp *stp;
 	uint16_t tsid;
 	time_t timeout;
 	int done;
-
-        struct pid_info pidi[0x2000];
+	int pending;		/* section filters not done yet */
+	int64_t now;		/* arrival of the data being processed */
+
+	struct sfilter **heap;	/* pending filters, min-heap on timeout */
+	int heap_len;
+	int heap_size;
+
+	unsigned int pids_dirty : 1;
+	unsigned int pids_sent  : 1;	/* server has a full PID list */
+	unsigned int pids_all   : 1;	/* switched to pids=all */
+	unsigned int pids_full  : 1;	/* server rejected addpids/delpids */
+	int64_t pids_deadline;
+	int pid_updates;
+
+	/* sparse PID map, leaves of PID_LEAF entries allocated on demand */
+	struct pid_info **pidmap[0x2000 / PID_LEAF];
 };
 
 #define MAX_ANUM 32
 
+struct event;
+
+#define EIT_TID0   0x4e		/* EIT tables are 0x4e..0x6f */
+#define EIT_TIDS   (0x6f - EIT_TID0 + 1)
+#define EV_DELETED 0xff		/* event.ver of a removed record */
+
+/*
+ * EIT events of a service: fixed size records in one array, growing by
+ * doubling, and a string blob holding the short event names and texts
+ * as in the descriptor, a length byte followed by the characters.
+ * Records refer to their strings by offset, 0 is none. Both go in one
+ * free() each with the service.
+ *
+ * Records are indexed on (event_id, table_id) by open addressing, so a
+ * section updates its own events in place. The present/following and
+ * the schedule copy of an event stay separate records, as they come
+ * from different tables. Removed records stay in the array until more
+ * than half of it is garbage, replaced strings likewise in the blob.
+ */
+/* an event whose segment is not complete yet, see epg_segment() */
+struct evpend {
+	uint16_t eid;
+	uint8_t tid;
+	uint8_t snr;
+};
+
+struct evstore {
+	struct event *ev;
+	uint32_t nev;
+	uint32_t evsize;
+	uint32_t ndel;		/* removed records still in ev */
+	uint32_t *idx;		/* record + 1, 0 is empty */
+	uint32_t isize;		/* power of 2, at least twice nev */
+	uint8_t *str;
+	uint32_t slen;
+	uint32_t ssize;
+	uint32_t sfree;		/* bytes of replaced strings */
+	uint8_t tver[EIT_TIDS];	/* current version per table */
+	uint16_t tlive[EIT_TIDS];	/* live records per table */
+	uint16_t told[EIT_TIDS];	/* of them still from an older version */
+	uint8_t tdone[EIT_TIDS];	/* version + 1 of the last complete table */
+	struct evpend *pend;	/* --epg: events still to be written */
+	uint32_t npend;
+	uint32_t pendsize;
+	uint32_t changes;	/* events added, updated or removed */
+};
+
 struct service {
 	struct list_head link;
 	struct tp_info *tpi;
-	struct list_head events;
+	struct evstore evs;
+	struct epgdb_cache *dbc;	/* --epgdb records, see epgdb_cache_build() */
 
 	char name[80];
 	char pname[80];
@@ -174,6 +337,7 @@ struct service {
 	unsigned int ca_mode    : 1;
 	unsigned int eit_pf     : 1;
 	unsigned int eit_sched  : 1;
+	unsigned int epg_chan   : 1;	/* <channel> written (--epg=xmltv) */
 
 	uint16_t sid;
 	uint16_t tsid;
@@ -189,9 +353,6 @@ struct service {
 };
 
 struct event {
-	struct list_head link;
-	//~ struct tp_info *tpi;
-
 	uint16_t  onid;
 	uint16_t  tsid;
 	uint16_t  sid;
@@ -206,13 +367,13 @@ struct event {
 	uint8_t 	 ds;
 
 	uint8_t   s_lang[3];
-	uint8_t	 *s_name;
-	uint8_t	 *s_text;
-//	uint8_t   *extented;
-
 	uint8_t	 content;
-
 	uint8_t 	 tid;
+	uint8_t   snr;		/* section it came in */
+	uint8_t   ver;		/* its version, EV_DELETED once removed */
+
+	uint32_t  s_name;	/* offsets into evstore.str */
+	uint32_t  s_text;
 };
 
 #define MAX_EIT_SID 64
@@ -248,12 +409,68 @@ struct tp_info {
     uint32_t isi;          // Input Stream Identifier (DVB-S2)
 
     uint16_t eit_sid[MAX_EIT_SID];
+
+    /* EPG collection (--daemon), kept across rotations */
+    uint64_t epg_sections;  // EIT sections received
+    uint64_t epg_parsed;    // of them new or of a changed version
+    uint32_t epg_changes;   // table version changes
+    int64_t  epg_tuned_ms;  // time tuned in earlier sessions
+    int64_t  epg_since;     // start of the current session, 0 if none
+    int64_t  epg_fresh;     // last time its EIT was complete and current
+
+    struct tcycle *tcycles; // table repetition learned here, 256 or NULL
+};
+
+#define RTP_REORDER  8	/* datagrams held back behind a gap */
+#define RTP_HOLD_MS  50	/* longest wait for a missing datagram */
+#define RTP_RESYNC   1024	/* larger jumps restart the sequence */
+
+/*
+ * RTP sequence of a session. Datagrams that arrive ahead of a gap wait
+ * in a window of RTP_REORDER slots, so an overtaken datagram is put
+ * back in order before its packets reach the demuxer. A gap is given
+ * up as lost when the window is full or after RTP_HOLD_MS.
+ */
+struct rtp_seq {
+	unsigned int synced : 1;
+	uint16_t next;		/* sequence number expected */
+	int held;
+	int64_t held_since;
+	uint8_t *win;		/* RTP_REORDER slots of RTP_SLOT */
+	uint16_t wlen[RTP_REORDER];
+
+	uint32_t lost;
+	uint32_t reordered;	/* came late, but within the window */
+	uint32_t late;		/* after its gap was given up, or duplicate */
+	uint32_t bad;		/* not an RTP version 2 header */
 };
 
 struct scantp {
 	struct scanip *sip;
 	struct tp_info *tpi;
-	time_t timeout;
+	int64_t timeout;
+	int64_t last_data;
+
+	unsigned int tuned    : 1;	/* got data since the last tune */
+	unsigned int collected : 1;	/* tables done was reported */
+
+	int64_t tune_start;
+	int64_t pat_ms;		/* tune to first PAT, 0 before */
+	uint64_t rx_datagrams;
+	uint32_t rx_drops;	/* SO_RXQ_OVFL counter of the RTP socket */
+	struct rtp_seq rseq;
+
+	/* tuner status from the RTCP APP reports, the last one received */
+	int sig_reports;
+	int sig_level;		/* 0..255 */
+	int sig_lock;		/* ever reported locked since the tune */
+	int sig_quality;	/* 0..15 */
+
+	struct evsrc rtsp_ev;
+	struct evsrc rtp_ev;
+	struct evsrc rtcp_ev;
+	struct uring_recv *urtsp;	/* io_uring backend only */
+	struct uring_recv *urtp;
 
 	struct list_head sfilters;
 	struct ts_info tsi;
@@ -265,25 +482,266 @@ struct scanip {
 
 	struct list_head tps;
 	struct list_head tps_done;
-	struct scantp stp;
+	struct scantp *stp;
 	int done;
+
+	char *port;
+	int tuners;
+	int tcp;		/* server given as <ip>/tcp */
+	int http;		/* or as <ip>/http[:port] */
+	int active;
+	int scanned;
+	int tunes;		/* tune to first RTP data, for the summary */
+	int64_t tune_ms;
+	int pats;		/* tune to first PAT */
+	int64_t pat_ms;
+	int nolock;		/* given up after --lock_wait */
+	int64_t retry_at;	/* --daemon: no new session before */
 };
 
 
-static void free_event(struct event *e)
+/* a new zeroed record at the end, NULL if out of memory */
+static struct event *evstore_add(struct evstore *es)
 {
-	if (e->s_name) free(e->s_name);
-	if (e->s_text) free(e->s_text);
-	free(e);
+	struct event *ev;
+	uint32_t n;
+
+	if (es->nev == es->evsize) {
+		n = es->evsize ? es->evsize * 2 : 64;
+		ev = realloc(es->ev, n * sizeof(struct event));
+		if (!ev)
+			return NULL;
+		eit_allocs++;
+		es->ev = ev;
+		es->evsize = n;
+	}
+	ev = &es->ev[es->nev++];
+	memset(ev, 0, sizeof(struct event));
+	return ev;
 }
 
-static void free_service(struct service *s)
+/* copy a length prefixed string, returns its offset or 0 */
+static uint32_t evstore_str(struct evstore *es, const uint8_t *s)
+{
+	uint32_t n = s[0] + 1, size, off;
+	uint8_t *str;
+
+	if (!es->slen)
+		es->slen = 1;	/* offset 0 is none */
+	if (es->slen + n > es->ssize) {
+		size = es->ssize ? es->ssize : 4096;
+		while (size < es->slen + n)
+			size *= 2;
+		str = realloc(es->str, size);
+		if (!str)
+			return 0;
+		eit_allocs++;
+		es->str = str;
+		es->ssize = size;
+	}
+	off = es->slen;
+	memcpy(es->str + off, s, n);
+	es->slen += n;
+	return off;
+}
+
+/* string s (NULL if empty) for a record that had old, kept if unchanged */
+static uint32_t evstore_strset(struct evstore *es, uint32_t old, const uint8_t *s)
+{
+	if (old && s && !memcmp(es->str + old, s, s[0] + 1))
+		return old;
+	if (old)
+		es->sfree += es->str[old] + 1;
+	return s ? evstore_str(es, s) : 0;
+}
+
+static uint32_t evstore_hash(uint16_t eid, uint8_t tid)
+{
+	uint32_t h = ((uint32_t) eid << 8 | tid) * 0x9e3779b1;
+
+	return h ^ h >> 16;
+}
+
+/* index slot of (eid, tid), or the empty one to put it in */
+static uint32_t evstore_slot(struct evstore *es, uint16_t eid, uint8_t tid)
+{
+	uint32_t m = es->isize - 1, i, r;
+
+	for (i = evstore_hash(eid, tid) & m; (r = es->idx[i]); i = (i + 1) & m)
+		if (es->ev[r - 1].eid == eid && es->ev[r - 1].tid == tid)
+			break;
+	return i;
+}
+
+/* drop removed records and rebuild the index with size slots */
+static int evstore_reindex(struct evstore *es, uint32_t size)
+{
+	uint32_t *idx, i, n = 0;
+
+	idx = calloc(size, sizeof(uint32_t));
+	if (!idx)
+		return -1;
+	eit_allocs++;
+	for (i = 0; i < es->nev; i++)
+		if (es->ev[i].ver != EV_DELETED)
+			es->ev[n++] = es->ev[i];
+	es->nev = n;
+	es->ndel = 0;
+	free(es->idx);
+	es->idx = idx;
+	es->isize = size;
+	for (i = 0; i < n; i++)
+		idx[evstore_slot(es, es->ev[i].eid, es->ev[i].tid)] = i + 1;
+	return 0;
+}
+
+/* copy the strings still referenced into a fresh blob */
+static void evstore_repack(struct evstore *es)
+{
+	uint8_t *old = es->str;
+	struct event *e;
+
+	es->str = NULL;
+	es->slen = es->ssize = es->sfree = 0;
+	for (e = es->ev; e < es->ev + es->nev; e++) {
+		if (e->ver == EV_DELETED)
+			continue;
+		if (e->s_name)
+			e->s_name = evstore_str(es, old + e->s_name);
+		if (e->s_text)
+			e->s_text = evstore_str(es, old + e->s_text);
+	}
+	free(old);
+}
+
+/*
+ * A section of table tid with version vnr arrived. On a new version all
+ * live records of the table are old until a section updates them.
+ */
+static void evstore_version(struct evstore *es, uint8_t tid, uint8_t vnr)
+{
+	int t = tid - EIT_TID0;
+	uint32_t i, n = 0;
+
+	if (es->tver[t] == vnr)
+		return;
+	es->tver[t] = vnr;
+	es->told[t] = es->tlive[t];
+	/* the new version is written with its own segments */
+	for (i = 0; i < es->npend; i++)
+		if (es->pend[i].tid != tid)
+			es->pend[n++] = es->pend[i];
+	es->npend = n;
+}
+
+/* remember e for the writer until its segment is complete */
+static void evstore_pend(struct evstore *es, struct event *e)
+{
+	struct evpend *p;
+	uint32_t n;
+
+	if (es->npend == es->pendsize) {
+		n = es->pendsize ? es->pendsize * 2 : 64;
+		p = realloc(es->pend, n * sizeof(struct evpend));
+		if (!p)
+			return;
+		eit_allocs++;
+		es->pend = p;
+		es->pendsize = n;
+	}
+	p = &es->pend[es->npend++];
+	p->eid = e->eid;
+	p->tid = e->tid;
+	p->snr = e->snr;
+}
+
+/*
+ * Insert or update event e of a section, keyed by (eid, tid). name and
+ * text are the length prefixed strings in the section, NULL if empty.
+ * Returns 1 for a new event, 0 for an update, -1 if out of memory.
+ */
+static int evstore_upsert(struct evstore *es, struct event *e,
+			  const uint8_t *name, const uint8_t *text)
+{
+	int t = e->tid - EIT_TID0, new;
+	struct event *pe;
+	uint32_t i;
+
+	if (2 * (es->nev + 1) > es->isize &&
+	    evstore_reindex(es, es->isize ? es->isize * 2 : 128) < 0)
+		return -1;
+	i = evstore_slot(es, e->eid, e->tid);
+	if (es->idx[i]) {
+		pe = &es->ev[es->idx[i] - 1];
+		new = pe->ver == EV_DELETED;
+		if (new) {
+			es->ndel--;
+			pe->s_name = pe->s_text = 0;
+		} else if (pe->ver != e->ver) {
+			es->told[t]--;
+		}
+	} else {
+		pe = evstore_add(es);
+		if (!pe)
+			return -1;
+		es->idx[i] = es->nev;
+		new = 1;
+	}
+	e->s_name = evstore_strset(es, pe->s_name, name);
+	e->s_text = evstore_strset(es, pe->s_text, text);
+	*pe = *e;
+	es->tlive[t] += new;
+	es->changes++;
+	eit_changes++;
+	return new;
+}
+
+/*
+ * Remove the events of sections from..to of table tid that are still
+ * from an older version: the current version no longer has them.
+ * Only walks the records while the table is changing.
+ */
+static int evstore_expire(struct evstore *es, uint8_t tid, uint8_t vnr, int from, int to)
 {
-	struct event *pe,*npe;
-	list_for_each_entry_safe(pe, npe, &s->events, link) {
-		list_del(&pe->link);
-		free_event(pe);
+	int t = tid - EIT_TID0, n = 0;
+	struct event *e;
+
+	if (!es->told[t])
+		return 0;
+	for (e = es->ev; e < es->ev + es->nev; e++) {
+		if (e->tid != tid || e->ver == vnr || e->ver == EV_DELETED ||
+		    e->snr < from || e->snr > to)
+			continue;
+		if (e->s_name)
+			es->sfree += es->str[e->s_name] + 1;
+		if (e->s_text)
+			es->sfree += es->str[e->s_text] + 1;
+		e->ver = EV_DELETED;
+		n++;
 	}
+	es->ndel += n;
+	es->tlive[t] -= n;
+	es->told[t] -= n;
+	if (n) {
+		es->changes++;
+		eit_changes++;
+	}
+	if (es->nev >= 64 && es->ndel > es->nev / 2)
+		evstore_reindex(es, es->isize);
+	if (es->slen > 4096 && es->sfree > es->slen / 2)
+		evstore_repack(es);
+	return n;
+}
+
+static void epgdb_cache_free(struct epgdb_cache *c);
+
+static void free_service(struct service *s)
+{
+	epgdb_cache_free(s->dbc);
+	free(s->evs.ev);
+	free(s->evs.idx);
+	free(s->evs.str);
+	free(s->evs.pend);
 	free(s);
 }
 
@@ -294,6 +752,7 @@ static void free_tp_info(struct tp_info *p)
 		list_del(&ps->link);
 		free_service(ps);
 	}
+	free(p->tcycles);
 	free(p);
 }
 
@@ -306,7 +765,6 @@ static struct service *get_service(struct tp_info *tpi, uint16_t sid)
 			return s;
 	}
 	s = calloc(1, sizeof(struct service));
-	list_head_init(&s->events);
 	s->sid = sid;
 	snprintf(s->name, sizeof(s->name), "Service %d", sid);
 	snprintf(s->pname, sizeof(s->name), "~");
@@ -393,7 +851,9 @@ static int streamsock(const char *name, const char *port, struct sockaddr *sadr)
 		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
 		if (sock == -1)
 			continue;
-		if (!connect(sock, ai->ai_addr, ai->ai_addrlen)) {
+		/* connect completes in the event loop (EPOLLOUT) */
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+		if (!connect(sock, ai->ai_addr, ai->ai_addrlen) || errno == EINPROGRESS) {
 			*sadr = *ai->ai_addr;
 			break;
 		}
@@ -415,57 +875,63 @@ static const char *sockname(struct sockaddr *sadr, char *name)
 	return inet_ntop(sadr->sa_family, adr, name, INET6_ADDRSTRLEN);
 }
 
-static void send_setup(int s, char *host, char *port, char *tune,
-		       int *seq, uint16_t cport, int mc)
+static void rtsp_queue(struct satipcon *scon, const void *buf, int len);
+
+static void send_setup(struct satipcon *scon, uint16_t cport, int mc)
 {
-	uint8_t buf[256], opt[256] = { 0 };
+	uint8_t buf[256];
 	int len;
 
-	if (mc)
+	if (scon->tcp)
+		len = snprintf(buf, sizeof(buf),
+			       "SETUP rtsp://%s:%s/?%s RTSP/1.0\r\n"
+			       "CSeq: %d\r\n"
+			       "Transport: RTP/AVP/TCP;interleaved=0-1\r\n"
+			       "\r\n",
+			       scon->host, scon->port, scon->tune, scon->seq);
+	else if (mc)
 		len = snprintf(buf, sizeof(buf),
 			       "SETUP rtsp://%s:%s/?%s RTSP/1.0\r\n"
 			       "CSeq: %d\r\n"
 			       "Transport: RTP/AVP;multicast;port=%d-%d;ttl=3\r\n"
 			       "\r\n",
-			       host, port, tune,
-			       *seq , cport, cport + 1);
+			       scon->host, scon->port, scon->tune,
+			       scon->seq, cport, cport + 1);
 	else
 		len = snprintf(buf, sizeof(buf),
 			       "SETUP rtsp://%s:%s/?%s RTSP/1.0\r\n"
 			       "CSeq: %d\r\n"
 			       "Transport: RTP/AVP;unicast;client_port=%d-%d\r\n"
 			       "\r\n",
-			       host, port, tune,
-			       *seq , cport, cport + 1);
-	(*seq)++;
+			       scon->host, scon->port, scon->tune,
+			       scon->seq, cport, cport + 1);
+	scon->seq++;
 	if (len > 0 && len < sizeof(buf)) {
-		sendlen(s, buf, len);
+		rtsp_queue(scon, buf, len);
 		//fprintf(stderr, "Send: %s\n", buf);
 	}
 }
 
-static void send_play(int s, char *host, char *port, uint32_t strid,
-		      int *seq, char *sid)
+static void send_play(struct satipcon *scon, const char *query)
 {
-	uint8_t buf[1024];
+	uint8_t buf[2560];
 	int len;
 
 	len = snprintf(buf, sizeof(buf),
-		       "PLAY rtsp://%s:%s/stream=%u RTSP/1.0\r\n"
+		       "PLAY rtsp://%s:%s/stream=%u?%s RTSP/1.0\r\n"
 		       "CSeq: %d\r\n"
 		       "Session: %s\r\n"
 		       "\r\n",
-		       host, port, strid,
-		       *seq , sid);
-	(*seq)++;
+		       scon->host, scon->port, scon->strid, query,
+		       scon->seq, scon->sid);
+	scon->seq++;
 	if (len > 0 && len < sizeof(buf)) {
-		sendlen(s, buf, len);
+		rtsp_queue(scon, buf, len);
 		//fprintf(stderr, "Send: %s\n", buf);
 	}
 }
 
-static void send_teardown(int s, char *host, char *port, uint32_t strid,
-			  int *seq, char *sid)
+static void send_teardown(struct satipcon *scon)
 {
 	uint8_t buf[1024];
 	int len;
@@ -475,10 +941,10 @@ static void send_teardown(int s, char *host, char *port, uint32_t strid,
 		       "CSeq: %d\r\n"
 		       "Session: %s\r\n"
 		       "\r\n",
-		       host, port, strid, *seq , sid);
-	(*seq)++;
+		       scon->host, scon->port, scon->strid, scon->seq, scon->sid);
+	scon->seq++;
 	if (len > 0 && len < sizeof(buf)) {
-		sendlen(s, buf, len);
+		rtsp_queue(scon, buf, len);
 		//fprintf(stderr, "Send: %s\n", buf);
 	}
 }
@@ -532,25 +998,16 @@ static void getarg(char *b, char **a, char **ae)
 	**ae = 0;
 }
 
-static int check_ok(int s, char *sid, uint32_t *strid)
+/*
+ * Parse one reply header, b ends with the empty line.
+ * The buffer is modified.
+ */
+static int check_ok(char *b, int bl, char *sid, uint32_t *strid)
 {
-	char b[4096], *a, *ae;
-	int n, bl = 0, bs = sizeof(b);
+	char *a, *ae;
 	char *l, *e;
 	uint32_t sport, sport2;
 
-	while (1) {
-		n = recv(s, b + bl, bs - bl, 0);
-		if (n <= 0)
-			return 0;
-		if (n + bl > bs)
-			return -1;
-		bl += n;
-		if (bl >=4 &&
-		    b[bl - 4] == '\r' && b[bl - 3] == '\n' &&
-		    b[bl - 2] == '\r' && b[bl - 1] == '\n')
-			break;
-	}
 	b[bl-2] = 0;
 	if (strncasecmp(b, "RTSP/1.0 200 OK\r\n", 17))
 		return -1;
@@ -590,14 +1047,31 @@ static int check_ok(int s, char *sid, uint32_t *strid)
 	return 0;
 }
 
+static int rtsp_content_length(const char *b, const char *end)
+{
+	const char *l;
+
+	for (l = b; l < end; l++)
+		if ((l == b || l[-1] == '\n') &&
+		    !strncasecmp(l, "Content-Length:", 15))
+			return atoi(l + 15);
+	return 0;
+}
+
 /****************************************************************************/
-void add_fd(int fd, int *mfd, fd_set *fds)
+/* event loop */
+
+static int epfd = -1;
+
+static int ev_ctl(int op, int fd, struct evsrc *ev, uint32_t events)
 {
-	FD_SET(fd, fds);
-	if (fd > *mfd)
-		*mfd = fd;
+	struct epoll_event e = { .events = events, .data.ptr = ev };
+
+	return epoll_ctl(epfd, op, fd, &e);
 }
 
+/****************************************************************************/
+
 static inline uint16_t seclen(const uint8_t *buf)
 {
         return 3+((buf[1]&0x0f)<<8)+buf[2];
@@ -682,378 +1156,1148 @@ static uint32_t dvb_crc_table[256] = {
 	0x933eb0bb, 0x97ffad0c, 0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
 	0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4};
 
-uint32_t dvb_crc32(uint8_t *data, int len)
+/*
+ * MPEG-2 CRC-32 (poly 0x04c11db7, MSB first, no final xor). dvb_crc32()
+ * goes through crc_impl, chosen by crc_init(): carry-less multiply
+ * folding where the CPU has it, else slice-by-8, both checked against
+ * the byte-wise table loop at startup.
+ */
+#define CRC_POLY 0x04c11db7
+
+static uint32_t crc_byte(uint32_t crc, const uint8_t *data, int len)
 {
 	int i;
-	uint32_t crc=0xffffffff;
 
 	for (i = 0; i < len; i++)
                 crc = (crc << 8) ^ dvb_crc_table[((crc >> 24) ^ *data++) & 0xff];
 	return crc;
 }
 
-static void pid_info_init(struct pid_info *pidi, uint16_t pid, struct ts_info *tsi)
+static uint32_t crc_tab8[8][256];
+
+static uint32_t crc_slice8(uint32_t crc, const uint8_t *data, int len)
 {
-	memset(pidi, 0, sizeof(struct pid_info));
-	list_head_init(&pidi->sfilters);
-	pidi->pid=pid;
-	pidi->tsi=tsi;
+	for (; len >= 8; len -= 8, data += 8) {
+		crc ^= ((uint32_t) data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+		crc = crc_tab8[7][crc >> 24] ^ crc_tab8[6][(crc >> 16) & 0xff] ^
+		      crc_tab8[5][(crc >> 8) & 0xff] ^ crc_tab8[4][crc & 0xff] ^
+		      crc_tab8[3][data[4]] ^ crc_tab8[2][data[5]] ^
+		      crc_tab8[1][data[6]] ^ crc_tab8[0][data[7]];
+	}
+	return crc_byte(crc, data, len);
 }
 
-static void pid_info_release(struct pid_info *pidi)
+/* x^n mod P */
+static uint64_t crc_xpow(int n)
 {
-	struct sfilter *p, *n;
+	uint32_t r = 1;
 
-	list_for_each_entry_safe(p, n, &pidi->sfilters, link) {
-		list_del(&p->link);
-		free(p);
-	}
-	if (pidi->buf)
-		free(pidi->buf);
+	while (n--)
+		r = (r << 1) ^ ((r & 0x80000000) ? CRC_POLY : 0);
+	return r;
 }
 
-static inline void pid_info_reset(struct pid_info *pidi)
+/*
+ * Folding keeps a 128 bit remainder A = H * x^64 + L congruent to the
+ * data so far. Moving it n bits ahead is H * (x^(n+64) mod P) +
+ * L * (x^n mod P), two 64x32 bit carry-less products. Four lanes are
+ * folded by 512 bits, then merged and folded by 128 bits. The
+ * remainder's 16 bytes are finished with slice-by-8, which computes
+ * exactly A * x^32 mod P.
+ */
+static uint64_t crc_k512[2], crc_k128[2];	/* { L, H } */
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc_fold_x86(__m128i a, __m128i k)
 {
-	pidi->bufp = pidi->len = 0;
+	return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x00),
+			     _mm_clmulepi64_si128(a, k, 0x11));
 }
 
-static int update_pids(struct ts_info *tsi);
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc_clmul(uint32_t crc, const uint8_t *data, int len)
+{
+	const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+					    7, 6, 5, 4, 3, 2, 1, 0);
+	__m128i k512 = _mm_set_epi64x(crc_k512[1], crc_k512[0]);
+	__m128i k128 = _mm_set_epi64x(crc_k128[1], crc_k128[0]);
+	__m128i x0, x1, x2, x3;
+	uint8_t rem[16];
+
+	if (len < 64)
+		return crc_slice8(crc, data, len);
+	x0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), bswap);
+	x1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), bswap);
+	x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), bswap);
+	x3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), bswap);
+	x0 = _mm_xor_si128(x0, _mm_set_epi32(crc, 0, 0, 0));
+	for (data += 64, len -= 64; len >= 64; data += 64, len -= 64) {
+		x0 = _mm_xor_si128(crc_fold_x86(x0, k512), _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) data), bswap));
+		x1 = _mm_xor_si128(crc_fold_x86(x1, k512), _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) (data + 16)), bswap));
+		x2 = _mm_xor_si128(crc_fold_x86(x2, k512), _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) (data + 32)), bswap));
+		x3 = _mm_xor_si128(crc_fold_x86(x3, k512), _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) (data + 48)), bswap));
+	}
+	x0 = _mm_xor_si128(crc_fold_x86(x0, k128), x1);
+	x0 = _mm_xor_si128(crc_fold_x86(x0, k128), x2);
+	x0 = _mm_xor_si128(crc_fold_x86(x0, k128), x3);
+	for (; len >= 16; data += 16, len -= 16)
+		x0 = _mm_xor_si128(crc_fold_x86(x0, k128), _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) data), bswap));
+	_mm_storeu_si128((__m128i *) rem, _mm_shuffle_epi8(x0, bswap));
+	return crc_slice8(crc_slice8(0, rem, 16), data, len);
+}
 
-static int del_sfilter(struct sfilter *sf)
+static int crc_clmul_ok(void)
 {
-	list_del(&sf->link);
-	free(sf);
-	return 0;
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+#elif defined(__aarch64__) && defined(CRC_PMULL)
+/* PMULL folding, not verified on hardware yet: build with -DCRC_PMULL */
+__attribute__((target("+crypto")))
+static inline uint64x2_t crc_fold_a64(uint64x2_t a)
+{
+	return veorq_u64(
+		vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 0),
+						     (poly64_t) crc_k512[0])),
+		vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 1),
+						     (poly64_t) crc_k512[1])));
 }
 
-int cmp_tp(struct tp_info *a, struct tp_info *b)
+__attribute__((target("+crypto")))
+static inline uint64x2_t crc_fold128_a64(uint64x2_t a)
 {
-	if (a->msys != b->msys)
-		return 0;
-	if (a->src != b->src)
-		return 0;
-	if (a->freq != b->freq) {
-		if (a->freq != b->freq + 1 && a->freq != b->freq - 1)
-			return 0;
-	}
-	//~ if (a->mod != b->mod )
-		//~ return 0;
-	if (a->pol != b->pol )
-		return 0;
-	return 1;
+	return veorq_u64(
+		vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 0),
+						     (poly64_t) crc_k128[0])),
+		vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 1),
+						     (poly64_t) crc_k128[1])));
 }
 
-int add_tp(struct scanip *sip, struct tp_info *tpi_new)
+/* 16 bytes as a big endian 128 bit value */
+static inline uint64x2_t crc_load_a64(const uint8_t *p)
 {
-	struct tp_info *tpi, *p;
+	uint8x16_t v = vrev64q_u8(vld1q_u8(p));
 
-	list_for_each_entry(p, &sip->tps, link) {
-		if (cmp_tp(p, tpi_new))
-			return -1;
-	}
-	list_for_each_entry(p, &sip->tps_done, link) {
-		if (cmp_tp(p, tpi_new))
-			return -1;
-	}
-	tpi = malloc(sizeof(struct tp_info));
-	if (!tpi)
-		return -1;
-	memcpy(tpi, tpi_new, sizeof(struct tp_info));
-	//fprintf(stderr, "added tp freq = %u\n", tpi->freq);
-	list_add_tail(&tpi->link, &sip->tps);
-	list_head_init(&tpi->services);
-	return 0;
+	return vreinterpretq_u64_u8(vextq_u8(v, v, 8));
 }
 
-static int add_pid(struct ts_info *tsi, uint16_t pid, int add_ext)
+__attribute__((target("+crypto")))
+static uint32_t crc_clmul(uint32_t crc, const uint8_t *data, int len)
 {
-	struct pid_info *pidi = &tsi->pidi[pid];
-
-	if (!tsi->pidi[pid].used) {
-		pid_info_init(pidi, pid, tsi);
-		pidi->used = 1;
-		update_pids(tsi);
-		list_add_tail(&pidi->link, &tsi->pids);
+	uint64x2_t x0, x1, x2, x3;
+	uint8x16_t v;
+	uint8_t rem[16];
+
+	if (len < 64)
+		return crc_slice8(crc, data, len);
+	x0 = crc_load_a64(data);
+	x1 = crc_load_a64(data + 16);
+	x2 = crc_load_a64(data + 32);
+	x3 = crc_load_a64(data + 48);
+	x0 = veorq_u64(x0, vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t) crc << 32)));
+	for (data += 64, len -= 64; len >= 64; data += 64, len -= 64) {
+		x0 = veorq_u64(crc_fold_a64(x0), crc_load_a64(data));
+		x1 = veorq_u64(crc_fold_a64(x1), crc_load_a64(data + 16));
+		x2 = veorq_u64(crc_fold_a64(x2), crc_load_a64(data + 32));
+		x3 = veorq_u64(crc_fold_a64(x3), crc_load_a64(data + 48));
 	}
-	pidi->add_ext = add_ext;
-	return 0;
+	x0 = veorq_u64(crc_fold128_a64(x0), x1);
+	x0 = veorq_u64(crc_fold128_a64(x0), x2);
+	x0 = veorq_u64(crc_fold128_a64(x0), x3);
+	for (; len >= 16; data += 16, len -= 16)
+		x0 = veorq_u64(crc_fold128_a64(x0), crc_load_a64(data));
+	v = vrev64q_u8(vreinterpretq_u8_u64(x0));
+	vst1q_u8(rem, vextq_u8(v, v, 8));
+	return crc_slice8(crc_slice8(0, rem, 16), data, len);
 }
 
-static int add_sfilter(struct ts_info *tsi, uint16_t pid, uint8_t tid, uint16_t ext,
-		       int use_ext, uint32_t timeout)
+static int crc_clmul_ok(void)
 {
-	struct pid_info *pidi;
-	struct sfilter *sf;
+	return !!(getauxval(AT_HWCAP) & HWCAP_PMULL);
+}
+#else
+#define crc_clmul NULL
+static int crc_clmul_ok(void)
+{
+	return 0;
+}
+#endif
+
+static struct crc_impl {
+	const char *name;
+	uint32_t (*fn)(uint32_t crc, const uint8_t *data, int len);
+} crc_impls[] = {
+	{ "table", crc_byte },
+	{ "slice8", crc_slice8 },
+	{ "clmul", crc_clmul },
+};
 
-	add_pid(tsi, pid, use_ext ? 1 : 0);
-	pidi = &tsi->pidi[pid];
+static uint32_t (*crc_impl)(uint32_t crc, const uint8_t *data, int len) = crc_byte;
 
-	list_for_each_entry(sf, &pidi->sfilters, link) {
-			if (sf->tid == tid && sf->ext == ext)
+/* compare an implementation with the table loop */
+static int crc_check(struct crc_impl *ci)
+{
+	static uint8_t buf[4096 + 64];
+	int i, off, len;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 167 + (i >> 5);
+	for (len = 0; len <= 4096; len += len < 300 ? 1 : 61)
+		for (off = 0; off < 4; off++)
+			if (ci->fn(0xffffffff, buf + off, len) !=
+			    crc_byte(0xffffffff, buf + off, len))
 				return -1;
-	}
-	sf = calloc(1, sizeof(struct sfilter));
-	if (!sf)
-		return -1;
-	sf->pidi = pidi;
-	sf->tid = tid;
-	sf->ext = ext;
-	sf->use_ext = use_ext;
-	sf->vnr = 0xff;
-	sf->timeout_len = timeout;
-	sf->timeout = mtime(NULL) + sf->timeout_len;
-	list_add_tail(&sf->link, &pidi->sfilters);
-	list_add_tail(&sf->tslink, &pidi->tsi->sfilters);
-	//fprintf(stderr, "add_sfilter PID=%u TID=%u EXT=%u\n", pidi->pid, tid, ext);
 	return 0;
 }
 
-void ts_info_init(struct ts_info *tsi)
+static void crc_init(void)
 {
-	int i;
-
-	list_head_init(&tsi->pids);
-	list_head_init(&tsi->sfilters);
-	for (i=0; i<0x2000; i++)
-		pid_info_init(&tsi->pidi[i], i, tsi);
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc_tab8[0][i] = dvb_crc_table[i];
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc_tab8[k][i] = (crc_tab8[k - 1][i] << 8) ^
+				dvb_crc_table[crc_tab8[k - 1][i] >> 24];
+	crc_k512[0] = crc_xpow(512);
+	crc_k512[1] = crc_xpow(512 + 64);
+	crc_k128[0] = crc_xpow(128);
+	crc_k128[1] = crc_xpow(128 + 64);
+
+	for (i = 2; i >= 1; i--) {
+		if (i == 2 && !crc_clmul_ok())
+			continue;
+		if (!crc_check(&crc_impls[i])) {
+			crc_impl = crc_impls[i].fn;
+			return;
+		}
+		fprintf(stderr, "CRC %s does not match the table, not used\n",
+			crc_impls[i].name);
+	}
 }
 
-void ts_info_release(struct ts_info *tsi)
+uint32_t dvb_crc32(uint8_t *data, int len)
 {
-	int i;
-
-	for (i=0; i<0x2000; i++)
-		pid_info_release(&tsi->pidi[i]);
+	return crc_impl(0xffffffff, data, len);
 }
 
-static uint32_t getbcd(uint8_t *p, int l)
+/*
+ * Section reassembly buffers come from a pool shared by all sessions
+ * and are reused across transponders. Most PIDs only carry PSI sections
+ * of up to 1024 bytes (PAT, PMT, SDT, NIT), so a PID starts with a small
+ * buffer and is moved to a large one when a longer section begins.
+ */
+#define SECBUF_SMALL 1024
+#define SECBUF_LARGE 4096
+
+struct secbuf {
+	struct secbuf *next;
+};
+
+static struct secbuf *secbuf_pool[2];	/* small, large */
+
+static struct {
+	uint32_t gets;
+	uint32_t allocs[2];
+	uint32_t upgrades;
+} secbuf_stats;
+
+static uint8_t *secbuf_get(int large)
 {
-	int i;
-	uint32_t val = 0, t;
+	struct secbuf *b = secbuf_pool[large];
 
-	for (i = 0; i < l / 2; i++) {
-		t = (p[i] >> 4) * 10 + (p[i] & 0x0f);
-		val = val * 100 + t;
+	secbuf_stats.gets++;
+	if (b) {
+		secbuf_pool[large] = b->next;
+		return (uint8_t *) b;
 	}
-	if (l & 1)
-		val = val * 10 + (p[i] >> 4);
-	return val;
+	secbuf_stats.allocs[large]++;
+	return malloc(large ? SECBUF_LARGE : SECBUF_SMALL);
 }
 
-static uint16_t get16(uint8_t *p)
+static void secbuf_put(uint8_t *buf, int large)
 {
-	return (p[0] << 8) | p[1];
+	struct secbuf *b = (struct secbuf *) buf;
+
+	if (!b)
+		return;
+	b->next = secbuf_pool[large];
+	secbuf_pool[large] = b;
 }
 
-static uint16_t get12(uint8_t *p)
+static void secbuf_print_stats(void)
 {
-	return ((p[0] & 0x0f) << 8) | p[1];
+	fprintf(stderr, "Section buffers: %u handed out, %u allocated (%u x %d, %u x %d bytes), %u upgraded\n",
+		secbuf_stats.gets, secbuf_stats.allocs[0] + secbuf_stats.allocs[1],
+		secbuf_stats.allocs[0], SECBUF_SMALL, secbuf_stats.allocs[1], SECBUF_LARGE,
+		secbuf_stats.upgrades);
 }
 
-static uint16_t get_pid(uint8_t *pid)
+static void pid_info_init(struct pid_info *pidi, uint16_t pid, struct ts_info *tsi)
 {
-        uint16_t pp;
+	memset(pidi, 0, sizeof(struct pid_info));
+	list_head_init(&pidi->sfilters);
+	pidi->pid=pid;
+	pidi->tsi=tsi;
+}
 
-        pp = (pid[0] & 0x1f) << 8;
-        pp |= pid[1] &0xff;
-        return pp;
+static void pid_info_release(struct pid_info *pidi)
+{
+	struct sfilter *p, *n;
+
+	list_for_each_entry_safe(p, n, &pidi->sfilters, link) {
+		list_del(&p->link);
+		free(p);
+	}
+	free(pidi->sfh);
+	free(pidi->seen);
+	secbuf_put(pidi->buf, pidi->bufsize == SECBUF_LARGE);
 }
 
-static int get_desc(struct pid_info *p, uint8_t *buf, int length)
+static inline void pid_info_reset(struct pid_info *pidi)
 {
- 	int dlength;
- 	int c=0;
- 	uint16_t casys;
- 	uint16_t capid;
+	pidi->bufp = pidi->len = 0;
+	pidi->skip = 0;
+}
 
- 	while (c < length) {
- 		dlength = buf[c+1];
+static inline int64_t min64(int64_t a, int64_t b)
+{
+	return a < b ? a : b;
+}
 
- 		switch(buf[c]){
- 		case 0x02:
- 			break;
- 		case 0x03:
- 			break;
- 		case 0x09:
- 			if (!dlength)
-				break;
- 			casys =(buf[c+2]<<8)|buf[c+3];
- 			capid = get_pid(buf+c+4);
+static int update_pids(struct ts_info *tsi);
+void tpstring(struct tp_info *tpi, char *s, int slen);
+
+/*
+ * Table repetition learned during the scan, per table_id: period is an
+ * average over the intervals between two arrivals of section 0 of the
+ * same table, wait the longest a filter waited for its first section.
+ * Every transponder learns its own, networks differ in how often they
+ * send their tables; until it has enough samples the values learned
+ * over all transponders are used. Filter timeouts become a few of
+ * these cycles, bounded by the fixed values passed to add_sfilter().
+ */
+struct tcycle {
+	uint32_t period;	/* ms */
+	uint32_t periods;
+	uint32_t wait;		/* ms */
+	uint32_t waits;
+};
+
+static struct tcycle tcycles[256];
+
+#define TCYCLE_MULT    4
+#define TCYCLE_MIN_MS  2000
+#define TCYCLE_SAMPLES 3
+
+static void tcycle_add_period(struct tcycle *tc, uint32_t d)
+{
+	tc->period = tc->periods ? (tc->period * 7 + d) / 8 : d;
+	tc->periods++;
+}
+
+static void tcycle_add_wait(struct tcycle *tc, uint32_t d)
+{
+	if (d > tc->wait)
+		tc->wait = d;
+	tc->waits++;
+}
+
+static struct tcycle *tp_tcycles(struct tp_info *tpi)
+{
+	if (!tpi->tcycles)
+		tpi->tcycles = calloc(256, sizeof(struct tcycle));
+	return tpi->tcycles;
+}
+
+static void tcycle_period(struct tp_info *tpi, uint8_t tid, uint32_t d)
+{
+	struct tcycle *tc = tp_tcycles(tpi);
+
+	if (!d || d > 120000)
+		return;
+	tcycle_add_period(&tcycles[tid], d);
+	if (tc)
+		tcycle_add_period(&tc[tid], d);
+}
+
+static void tcycle_wait(struct tp_info *tpi, uint8_t tid, int64_t d)
+{
+	struct tcycle *tc = tp_tcycles(tpi);
+
+	if (d < 0)
+		return;
+	tcycle_add_wait(&tcycles[tid], d);
+	if (tc)
+		tcycle_add_wait(&tc[tid], d);
+}
+
+/* learned timeout in ms, 0 while there are too few samples */
+static int64_t tcycle_timeout(struct tcycle *tc)
+{
+	int64_t t;
+
+	if (tc->periods + tc->waits < TCYCLE_SAMPLES)
+		return 0;
+	t = (int64_t) TCYCLE_MULT * (tc->period > tc->wait ? tc->period : tc->wait);
+	return t < TCYCLE_MIN_MS ? TCYCLE_MIN_MS : t;
+}
+
+/* timeout of a filter in ms */
+static int64_t sfilter_timeout(struct sfilter *sf)
+{
+	struct tcycle *tc = sf->pidi->tsi->stp->tpi->tcycles;
+	int64_t t = tc ? tcycle_timeout(&tc[sf->tid]) : 0;
+	int64_t max = (int64_t) sf->timeout_len * 1000;
+
+	if (!t)
+		t = tcycle_timeout(&tcycles[sf->tid]);
+	return t && t < max ? t : max;
+}
+
+/*
+ * Filter deadlines are kept in a binary min-heap per ts_info, so the
+ * event loop only looks at the earliest one instead of walking every
+ * filter each iteration.
+ */
+static void sf_heap_set(struct ts_info *tsi, int i, struct sfilter *sf)
+{
+	tsi->heap[i] = sf;
+	sf->hidx = i;
+}
+
+static void sf_heap_up(struct ts_info *tsi, int i)
+{
+	struct sfilter *sf = tsi->heap[i];
+	int parent;
+
+	while (i) {
+		parent = (i - 1) / 2;
+		if (tsi->heap[parent]->timeout <= sf->timeout)
 			break;
-		default:
+		sf_heap_set(tsi, i, tsi->heap[parent]);
+		i = parent;
+	}
+	sf_heap_set(tsi, i, sf);
+}
+
+static void sf_heap_down(struct ts_info *tsi, int i)
+{
+	struct sfilter *sf = tsi->heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < tsi->heap_len) {
+		if (child + 1 < tsi->heap_len &&
+		    tsi->heap[child + 1]->timeout < tsi->heap[child]->timeout)
+			child++;
+		if (sf->timeout <= tsi->heap[child]->timeout)
 			break;
-		}
-		c += dlength + 2;
+		sf_heap_set(tsi, i, tsi->heap[child]);
+		i = child;
 	}
-	return length;
+	sf_heap_set(tsi, i, sf);
 }
 
-static int update_pids(struct ts_info *tsi)
+static int sf_heap_add(struct ts_info *tsi, struct sfilter *sf)
 {
-    struct satipcon *scon = &tsi->stp->scon;
-    uint8_t buf[2048];
-    char pids[1024];
-    int len, len2, plen;
-    uint32_t pid;
-
-    for (pid = 0, plen = 0; pid < 8192; pid++) {
-        if (tsi->pidi[pid].used) {
-            len2 = snprintf(pids + plen, sizeof(pids) - plen, ",%u", pid);
-            if (len2 < 0 || plen + len2 >= sizeof(pids) - 1) {
-                fprintf(stderr, "PID buffer full, some PIDs may be omitted!\n");
-                break;
-            }
-            plen += len2;
-        }
-    }
-    pids[0] = '=';
-    if (!plen)
-        snprintf(pids, sizeof(pids), "=none");
-    else
-        fprintf(stderr, "Sending PIDs: %s\n", pids + 1); // Log wszystkich PID-ów
-
-    len = snprintf(buf, sizeof(buf),
-                   "PLAY rtsp://%s:%s/stream=%u?%s&pids%s RTSP/1.0\r\n"
-                   "CSeq: %d\r\n"
-                   "Session: %s\r\n"
-                   "\r\n",
-                   scon->host, scon->port, scon->strid, &scon->tune[0], pids,
-                   scon->seq, scon->sid);
-    scon->seq++;
-    if (len > 0 && len < sizeof(buf)) {
-        sendlen(scon->sock, buf, len);
-    }
-    return 0;
+	struct sfilter **heap;
+
+	if (tsi->heap_len == tsi->heap_size) {
+		heap = realloc(tsi->heap, (tsi->heap_size + 64) * sizeof(*heap));
+		if (!heap)
+			return -1;
+		tsi->heap = heap;
+		tsi->heap_size += 64;
+	}
+	sf_heap_set(tsi, tsi->heap_len++, sf);
+	sf_heap_up(tsi, sf->hidx);
+	return 0;
 }
-static int hasdesc(uint8_t stag, uint8_t *b, int dll)
+
+static void sf_heap_del(struct ts_info *tsi, struct sfilter *sf)
+{
+	int i = sf->hidx;
+
+	if (i < 0)
+		return;
+	sf->hidx = -1;
+	if (--tsi->heap_len == i)
+		return;
+	sf_heap_set(tsi, i, tsi->heap[tsi->heap_len]);
+	sf_heap_up(tsi, i);
+	sf_heap_down(tsi, tsi->heap[i]->hidx);
+}
+
+static void sfilter_set_timeout(struct sfilter *sf, int64_t t)
+{
+	sf->timeout = t;
+	if (sf->hidx >= 0) {
+		sf_heap_up(sf->pidi->tsi, sf->hidx);
+		sf_heap_down(sf->pidi->tsi, sf->hidx);
+	}
+}
+
+static void sfilter_arm(struct sfilter *sf, int64_t now)
+{
+	sf->start = now;
+	sfilter_set_timeout(sf, now + sfilter_timeout(sf));
+}
+
+static inline int64_t ts_info_now(struct ts_info *tsi)
+{
+	return tsi->now ? tsi->now : mtime_ms();
+}
+
+/* note section 0 of a table, a repeated one gives a period sample */
+static void pid_info_seen(struct pid_info *p, uint8_t tid, uint16_t ext, uint32_t now)
 {
+	struct tseen *ts;
 	int i;
 
-	for (i = 0; i < dll; i += b[i + 1] + 2) {
-		if (stag == b[i])
-			return 1;
+	for (i = 0; i < p->nseen; i++) {
+		ts = &p->seen[i];
+		if (ts->tid != tid)
+			continue;
+		if (ts->ext == ext) {
+			tcycle_period(p->tsi->stp->tpi, tid, now - ts->t);
+			ts->t = now;
+		}
+		return;
 	}
-	return 0;
+	if (p->nseen == p->seensize) {
+		if (p->seensize == 128)
+			return;
+		ts = realloc(p->seen, (p->seensize + 8) * sizeof(*ts));
+		if (!ts)
+			return;
+		p->seen = ts;
+		p->seensize += 8;
+	}
+	ts = &p->seen[p->nseen++];
+	ts->tid = tid;
+	ts->ext = ext;
+	ts->t = now;
 }
 
+static void tcycle_print(const char *what, struct tcycle *tc)
+{
+	int i;
 
-static int pmt_cb(struct sfilter *sf)
+	for (i = 0; i < 256; i++) {
+		if (!tc[i].periods && !tc[i].waits)
+			continue;
+		fprintf(stderr, "%s TID %02x: period %u ms (%u samples), first section within %u ms (%u filters), timeout %lld ms\n",
+			what, i, tc[i].period, tc[i].periods, tc[i].wait, tc[i].waits,
+			(long long) tcycle_timeout(&tc[i]));
+	}
+}
+
+static void tcycle_stats(struct scanip *sips, int nsips)
 {
-	struct pid_info *p = sf->pidi;
-	uint8_t *buf=p->buf;
-	int slen, ilen, eslen, c;
-	uint16_t epid, pnr;
-	struct service *s;
+	struct list_head *lists[2];
+	struct tp_info *tpi;
+	char tune[256];
+	int i, j;
 
-	slen = get12(buf + 1) + 3;
-	pnr = get16(buf + 3);
-	if (pnr != sf->ext)
-		return 0;
-	//fprintf( stderr, "PMT %04x:  PNR %04x\n", p->pid, pnr);
-	//fprintf( stderr, " snr %02x lsnr %02x", buf[6], buf[7]);
-	//dump(buf, p->len);
-	c = 12;
-	if ((ilen = get12(buf + 10)))
-		c += get_desc(p, buf + c, ilen);
-	if (c != 12 + ilen)
- 		return 0;
-	s = get_service(p->tsi->stp->tpi, pnr);
-	s->pcr = get_pid(buf + 8);
-	s->anum = 0;
-	s->pmt = p->pid;
-	while (c < slen -4 ) {
-		eslen = get12(buf + c + 3);
-		epid = get_pid(buf + c + 1);
-		//fprintf(stderr, " TYPE %02X INDEX %02X PID %d len %u\n", buf[c], buf[c + 5], epid, eslen, eslen);
-		//dump(buf + c, eslen + 5);
-		switch (buf[c]) {
-		case 0x01: // MPEG1
-		case 0x02: // MPEG2
-		case 0x10: // MPEG4
-		case 0x1b: // H264
-		case 0x24: // HEVC
-		case 0x42: // CAVS
-		case 0xea: // VC1
-		case 0xd1: // DIRAC
-			//fprintf( stderr, "Video   PID 0x%02X : %d\n", buf[c], epid);
-			s->vpid = epid;
-			break;
-		case 0x03: // MPEG1
-		case 0x04: // MPEG2
-		case 0x0F: // AAC
-		case 0x11: // AAC_LATM
-		case 0x81: // AC3
-		case 0x82: // DTS
-		case 0x83: // TRUEHD
-			//fprintf( stderr, "Audio   PID 0x%02X : %d\n", buf[c], epid);
-			if (s->anum < MAX_ANUM)
-				s->apid[s->anum++] = epid;
-			//fprintf(stderr, "  APID %04x", epid);
-			break;
-		case 0x06:
-			if (hasdesc(0x56, buf + c + 5, eslen))
-				s->ttx = epid;
-			else if (hasdesc(0x59, buf + c + 5, eslen))
-			        s->sub = epid;
-			else 
-			{
-				if (
-							(hasdesc(0x0a, buf + c + 5, eslen))
-						||	(hasdesc(0x6a, buf + c + 5, eslen))
-						||	(hasdesc(0x7a, buf + c + 5, eslen))
-					) 
-				{
-				if (s->anum < MAX_ANUM)
-					s->apid[s->anum++] = epid;
-				}
+	for (i = 0; i < nsips; i++) {
+		lists[0] = &sips[i].tps_done;
+		lists[1] = &sips[i].tps;
+		for (j = 0; j < 2; j++) {
+			list_for_each_entry(tpi, lists[j], link) {
+				if (!tpi->tcycles)
+					continue;
+				tpstring(tpi, tune, sizeof(tune));
+				tcycle_print(tune, tpi->tcycles);
 			}
-			break;
-		case 0x05: // PRIVATE
-			//fprintf( stderr, "Private PID 0x%02X : %d\n", buf[c], epid);
-			break;
-		default:
-			//fprintf(" stderr, Unkown  PID 0x%02X : %d\n", buf[c], epid);
-			break;
 		}
-		c += 5;
-		c += eslen;
-		//if (eslen)
-		//	c+=get_desc(p, buf+c, eslen);
 	}
-	s->got_pmt = 1;
-	//fprintf(stderr, "\n");
-	return 0;
+	tcycle_print("All", tcycles);
+}
+
+/*
+ * PID changes are collected for a short window and then sent in one
+ * PLAY, so a PAT with many programs costs a single round-trip.
+ */
+#define PID_COALESCE_MS 50
+#define PIDS_ALL_MAX    48	/* ask for pids=all above this */
 
+static void pids_schedule(struct ts_info *tsi)
+{
+	if (!tsi->pids_dirty) {
+		tsi->pids_dirty = 1;
+		tsi->pids_deadline = mtime_ms() + PID_COALESCE_MS;
+	}
 }
 
-static int nit_cb(struct sfilter *sf)
+/* stop receiving a PID once all its filters are done */
+static void pid_info_check_done(struct pid_info *p)
 {
-    struct pid_info *p = sf->pidi;
-    struct scanip *sip = p->tsi->stp->sip;
-    uint8_t *buf = p->buf;
-    int slen, tsp, c;
-    uint16_t nid;
-    uint16_t ndl, tsll, tdl;
-    struct tp_info t;
+	if (!p->active || p->nsf)
+		return;
+	p->active = 0;
+	pids_schedule(p->tsi);
+}
 
-    slen = get12(buf + 1) + 3;
-    if (buf[1] & 0x80)
-        slen -= 4;
-    nid = get16(buf + 3);
-    ndl = get12(buf + 8);
-    tsp = 10 + ndl;
-    tsll = get12(buf + tsp);
+/*
+ * Filters of a PID are hashed on (table_id, extension). Filters that
+ * still have to learn their extension from the first section (use_ext
+ * 0 or 1) are keyed on the table_id alone.
+ */
+#define SFH_WILD 0x1000000
 
-    if (p->tsi->stp->tpi->use_nit) {
-        for (c = tsp + 2; c < slen; c += tdl) {
-            memset(&t, 0, sizeof(struct tp_info));
-            t.tsid = get16(buf + c);
-            t.onid = get16(buf + c + 2);
-            t.nid = nid;
-            t.use_nit = p->tsi->stp->tpi->use_nit;
-            t.scan_eit = p->tsi->stp->tpi->scan_eit;
-            tdl = get12(buf + c + 4);
-            c += 6;
+static inline uint32_t sfh_key(uint8_t tid, uint16_t ext, int exact)
+{
+	return exact ? (tid << 16) | ext : SFH_WILD | (tid << 16);
+}
+
+static inline uint32_t sf_key(const struct sfilter *sf)
+{
+	return sfh_key(sf->tid, sf->ext, sf->use_ext == 2);
+}
+
+static inline struct sfilter **sfh_bucket(struct pid_info *p, uint32_t key)
+{
+	return &p->sfh[((key * 0x9e3779b1) >> 16) & (p->sfh_size - 1)];
+}
+
+static struct sfilter *sfh_find(struct pid_info *p, uint32_t key)
+{
+	struct sfilter *sf;
+
+	if (!p->nsf)
+		return NULL;
+	for (sf = *sfh_bucket(p, key); sf; sf = sf->hnext)
+		if (sf_key(sf) == key)
+			return sf;
+	return NULL;
+}
+
+static int sfh_insert(struct pid_info *p, struct sfilter *sf)
+{
+	struct sfilter **old = p->sfh, *e, **b;
+	int i, size = p->sfh_size;
+
+	if (p->nsf >= p->sfh_size) {
+		p->sfh = calloc(size ? size * 2 : 8, sizeof(*p->sfh));
+		if (!p->sfh) {
+			p->sfh = old;
+			return -1;
+		}
+		p->sfh_size = size ? size * 2 : 8;
+		for (i = 0; i < size; i++) {
+			while ((e = old[i])) {
+				old[i] = e->hnext;
+				b = sfh_bucket(p, sf_key(e));
+				e->hnext = *b;
+				*b = e;
+			}
+		}
+		free(old);
+	}
+	b = sfh_bucket(p, sf_key(sf));
+	sf->hnext = *b;
+	*b = sf;
+	p->nsf++;
+	return 0;
+}
+
+static void sfh_remove(struct pid_info *p, struct sfilter *sf)
+{
+	struct sfilter **b;
+
+	for (b = sfh_bucket(p, sf_key(sf)); *b; b = &(*b)->hnext) {
+		if (*b == sf) {
+			*b = sf->hnext;
+			p->nsf--;
+			return;
+		}
+	}
+}
+
+static int del_sfilter(struct sfilter *sf)
+{
+	struct pid_info *p = sf->pidi;
+
+	sfh_remove(p, sf);
+	list_del(&sf->link);
+	free(sf);
+	pid_info_check_done(p);
+	return 0;
+}
+
+/*
+ * A transponder is complete once every filter is done: PAT, the PMTs
+ * it announces, SDT actual, NIT if requested and EIT in EIT mode. The
+ * callbacks add dependent filters before their own filter completes.
+ */
+static void sfilter_done(struct sfilter *sf)
+{
+	struct ts_info *tsi = sf->pidi->tsi;
+
+	list_del(&sf->tslink);
+	sf_heap_del(tsi, sf);
+	del_sfilter(sf);
+	if (!--tsi->pending)
+		tsi->done = 1;
+}
+
+/*
+ * A filter has all its sections or timed out. In daemon mode an EIT
+ * filter stays matched, so that a new version of its table is parsed
+ * again; it only stops counting as pending.
+ */
+static void sfilter_finish(struct sfilter *sf)
+{
+	struct ts_info *tsi = sf->pidi->tsi;
+
+	if (!daemon_dwell || sf->tid < EIT_TID0 || sf->tid > 0x6f) {
+		sfilter_done(sf);
+		return;
+	}
+	if (sf->kept)
+		return;
+	sf->kept = 1;
+	list_del(&sf->tslink);
+	sf_heap_del(tsi, sf);
+	if (!--tsi->pending)
+		tsi->done = 1;
+}
+
+/* a kept filter sees a new version, the table is pending again */
+static void sfilter_reopen(struct sfilter *sf, int64_t now)
+{
+	struct ts_info *tsi = sf->pidi->tsi;
+
+	if (!sf->kept || sf_heap_add(tsi, sf) < 0)
+		return;
+	sf->kept = 0;
+	sfilter_arm(sf, now);
+	list_add_tail(&sf->tslink, &tsi->sfilters);
+	tsi->pending++;
+	tsi->done = 0;
+}
+
+int cmp_tp(struct tp_info *a, struct tp_info *b)
+{
+	if (a->msys != b->msys)
+		return 0;
+	if (a->src != b->src)
+		return 0;
+	if (a->freq != b->freq) {
+		if (a->freq != b->freq + 1 && a->freq != b->freq - 1)
+			return 0;
+	}
+	//~ if (a->mod != b->mod )
+		//~ return 0;
+	if (a->pol != b->pol )
+		return 0;
+	return 1;
+}
+
+int add_tp(struct scanip *sip, struct tp_info *tpi_new)
+{
+	struct tp_info *tpi, *p;
+
+	list_for_each_entry(p, &sip->tps, link) {
+		if (cmp_tp(p, tpi_new))
+			return -1;
+	}
+	list_for_each_entry(p, &sip->tps_done, link) {
+		if (cmp_tp(p, tpi_new))
+			return -1;
+	}
+	tpi = malloc(sizeof(struct tp_info));
+	if (!tpi)
+		return -1;
+	memcpy(tpi, tpi_new, sizeof(struct tp_info));
+	//fprintf(stderr, "added tp freq = %u\n", tpi->freq);
+	list_add_tail(&tpi->link, &sip->tps);
+	list_head_init(&tpi->services);
+	return 0;
+}
+
+
+static inline struct pid_info *pid_lookup(struct ts_info *tsi, uint16_t pid)
+{
+	struct pid_info **leaf = tsi->pidmap[pid / PID_LEAF];
+
+	return leaf ? leaf[pid % PID_LEAF] : NULL;
+}
+
+static struct pid_info *add_pid(struct ts_info *tsi, uint16_t pid, int add_ext)
+{
+	struct pid_info **leaf = tsi->pidmap[pid / PID_LEAF];
+	struct pid_info *pidi;
+
+	if (!leaf) {
+		leaf = calloc(PID_LEAF, sizeof(*leaf));
+		if (!leaf)
+			return NULL;
+		tsi->pidmap[pid / PID_LEAF] = leaf;
+	}
+	pidi = leaf[pid % PID_LEAF];
+	if (!pidi) {
+		pidi = malloc(sizeof(*pidi));
+		if (!pidi)
+			return NULL;
+		pid_info_init(pidi, pid, tsi);
+		leaf[pid % PID_LEAF] = pidi;
+		list_add_tail(&pidi->link, &tsi->pids);
+	}
+	if (!pidi->active) {
+		pidi->active = 1;
+		pidi->cc = 0xff;
+		pid_info_reset(pidi);
+		pids_schedule(tsi);
+	}
+	pidi->add_ext = add_ext;
+	return pidi;
+}
+
+static int add_sfilter(struct ts_info *tsi, uint16_t pid, uint8_t tid, uint16_t ext,
+		       int use_ext, uint32_t timeout)
+{
+	struct pid_info *pidi;
+	struct sfilter *sf;
+
+	pidi = add_pid(tsi, pid, use_ext ? 1 : 0);
+	if (!pidi)
+		return -1;
+
+	if (sfh_find(pidi, sfh_key(tid, ext, use_ext == 2)))
+		return -1;
+	sf = calloc(1, sizeof(struct sfilter));
+	if (!sf)
+		return -1;
+	sf->pidi = pidi;
+	sf->tid = tid;
+	sf->ext = ext;
+	sf->use_ext = use_ext;
+	sf->vnr = 0xff;
+	sf->timeout_len = timeout;
+	sf->hidx = -1;
+	sfilter_arm(sf, ts_info_now(tsi));
+	if (sfh_insert(pidi, sf) < 0) {
+		free(sf);
+		return -1;
+	}
+	if (sf_heap_add(tsi, sf) < 0) {
+		sfh_remove(pidi, sf);
+		free(sf);
+		return -1;
+	}
+	list_add_tail(&sf->link, &pidi->sfilters);
+	list_add_tail(&sf->tslink, &pidi->tsi->sfilters);
+	pidi->tsi->pending++;
+	//fprintf(stderr, "add_sfilter PID=%u TID=%u EXT=%u\n", pidi->pid, tid, ext);
+	return 0;
+}
+
+void ts_info_init(struct ts_info *tsi)
+{
+	list_head_init(&tsi->pids);
+	list_head_init(&tsi->sfilters);
+}
+
+void ts_info_release(struct ts_info *tsi)
+{
+	struct pid_info *p, *n;
+	int i;
+
+	list_for_each_entry_safe(p, n, &tsi->pids, link) {
+		list_del(&p->link);
+		pid_info_release(p);
+		free(p);
+	}
+	for (i = 0; i < 0x2000 / PID_LEAF; i++) {
+		free(tsi->pidmap[i]);
+		tsi->pidmap[i] = NULL;
+	}
+	free(tsi->heap);
+	tsi->heap = NULL;
+	tsi->heap_len = tsi->heap_size = 0;
+}
+
+static uint32_t getbcd(uint8_t *p, int l)
+{
+	int i;
+	uint32_t val = 0, t;
+
+	for (i = 0; i < l / 2; i++) {
+		t = (p[i] >> 4) * 10 + (p[i] & 0x0f);
+		val = val * 100 + t;
+	}
+	if (l & 1)
+		val = val * 10 + (p[i] >> 4);
+	return val;
+}
+
+static uint16_t get16(uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint16_t get12(uint8_t *p)
+{
+	return ((p[0] & 0x0f) << 8) | p[1];
+}
+
+static uint16_t get_pid(uint8_t *pid)
+{
+        uint16_t pp;
+
+        pp = (pid[0] & 0x1f) << 8;
+        pp |= pid[1] &0xff;
+        return pp;
+}
+
+static int get_desc(struct pid_info *p, uint8_t *buf, int length)
+{
+ 	int dlength;
+ 	int c=0;
+ 	uint16_t casys;
+ 	uint16_t capid;
+
+ 	while (c < length) {
+ 		dlength = buf[c+1];
+
+ 		switch(buf[c]){
+ 		case 0x02:
+ 			break;
+ 		case 0x03:
+ 			break;
+ 		case 0x09:
+ 			if (!dlength)
+				break;
+ 			casys =(buf[c+2]<<8)|buf[c+3];
+ 			capid = get_pid(buf+c+4);
+			break;
+		default:
+			break;
+		}
+		c += dlength + 2;
+	}
+	return length;
+}
+
+static int pids_append(char *b, int *len, int size, uint16_t pid)
+{
+    int n = snprintf(b + *len, size - *len, "%s%u", *len ? "," : "", pid);
+
+    if (n < 0 || *len + n >= size)
+        return -1;
+    *len += n;
+    return 0;
+}
+
+static int http_get(struct scantp *stp, const char *query);
+static int http_restart(struct scantp *stp);
+
+/*
+ * Send the pending PID changes. The first PLAY carries the full list,
+ * later ones only addpids=/delpids= deltas, unless the server refused
+ * those. Large sets (or lists that do not fit) switch to pids=all.
+ * An HTTP request cannot change its PIDs: it carries the full list,
+ * and only added PIDs make a new one (removed ones are dropped by the
+ * demuxer). Changes while the request is still on its way wait for its
+ * reply. With --http_all the first request asks for pids=all instead.
+ */
+static int update_pids(struct ts_info *tsi)
+{
+    struct satipcon *scon = &tsi->stp->scon;
+    struct pid_info *p;
+    char add[1024], del[1024], query[2100];
+    int alen = 0, dlen = 0, n = 0, added = 0, full, err = 0;
+
+    if (scon->state == RTSP_IDLE)
+        return 0;
+    if (scon->http && (scon->state == RTSP_CONNECT || scon->pending)) {
+        tsi->pids_deadline = mtime_ms() + PID_COALESCE_MS;
+        return 0;
+    }
+    tsi->pids_dirty = 0;
+    if (tsi->pids_all)
+        return 0;
+
+    full = !tsi->pids_sent || tsi->pids_full || scon->http;
+    list_for_each_entry(p, &tsi->pids, link) {
+        n += p->active;
+        added += p->active && !p->sent;
+        if (full ? p->active : (p->active && !p->sent))
+            err |= pids_append(add, &alen, sizeof(add), p->pid);
+        else if (!full && !p->active && p->sent)
+            err |= pids_append(del, &dlen, sizeof(del), p->pid);
+    }
+
+    if (scon->http && scon->state == RTSP_RUNNING) {
+        list_for_each_entry(p, &tsi->pids, link)
+            p->sent = p->active;
+        /* the new request goes out from stp_tune() once connected */
+        return added ? http_restart(tsi->stp) : 0;
+    }
+    if (n > PIDS_ALL_MAX || err || (scon->http && http_pids_all)) {
+        if (!scon->http)
+            fprintf(stderr, "%d PIDs, switching to pids=all\n", n);
+        tsi->pids_all = 1;
+        snprintf(query, sizeof(query), "%s&pids=all", scon->tune);
+    } else if (full) {
+        if (alen)
+            fprintf(stderr, "Sending PIDs: %s\n", add); // Log wszystkich PID-ów
+        snprintf(query, sizeof(query), "%s&pids=%s", scon->tune, alen ? add : "none");
+    } else {
+        if (!alen && !dlen)
+            return 0;
+        fprintf(stderr, "PIDs +%s -%s\n", alen ? add : "", dlen ? del : "");
+        snprintf(query, sizeof(query), "%s%s%s%s%s",
+                 alen ? "addpids=" : "", alen ? add : "", alen && dlen ? "&" : "",
+                 dlen ? "delpids=" : "", dlen ? del : "");
+    }
+    list_for_each_entry(p, &tsi->pids, link)
+        p->sent = p->active;
+    tsi->pids_sent = 1;
+    tsi->pid_updates++;
+
+    if (scon->http)
+        return http_get(tsi->stp, query);
+    send_play(scon, query);
+    return 0;
+}
+static int hasdesc(uint8_t stag, uint8_t *b, int dll)
+{
+	int i;
+
+	for (i = 0; i < dll; i += b[i + 1] + 2) {
+		if (stag == b[i])
+			return 1;
+	}
+	return 0;
+}
+
+
+static int pmt_cb(struct sfilter *sf)
+{
+	struct pid_info *p = sf->pidi;
+	uint8_t *buf=p->buf;
+	int slen, ilen, eslen, c;
+	uint16_t epid, pnr;
+	struct service *s;
+
+	slen = get12(buf + 1) + 3;
+	pnr = get16(buf + 3);
+	if (pnr != sf->ext)
+		return 0;
+	//fprintf( stderr, "PMT %04x:  PNR %04x\n", p->pid, pnr);
+	//fprintf( stderr, " snr %02x lsnr %02x", buf[6], buf[7]);
+	//dump(buf, p->len);
+	c = 12;
+	if ((ilen = get12(buf + 10)))
+		c += get_desc(p, buf + c, ilen);
+	if (c != 12 + ilen)
+ 		return 0;
+	s = get_service(p->tsi->stp->tpi, pnr);
+	s->pcr = get_pid(buf + 8);
+	s->anum = 0;
+	s->pmt = p->pid;
+	while (c < slen -4 ) {
+		eslen = get12(buf + c + 3);
+		epid = get_pid(buf + c + 1);
+		//fprintf(stderr, " TYPE %02X INDEX %02X PID %d len %u\n", buf[c], buf[c + 5], epid, eslen, eslen);
+		//dump(buf + c, eslen + 5);
+		switch (buf[c]) {
+		case 0x01: // MPEG1
+		case 0x02: // MPEG2
+		case 0x10: // MPEG4
+		case 0x1b: // H264
+		case 0x24: // HEVC
+		case 0x42: // CAVS
+		case 0xea: // VC1
+		case 0xd1: // DIRAC
+			//fprintf( stderr, "Video   PID 0x%02X : %d\n", buf[c], epid);
+			s->vpid = epid;
+			break;
+		case 0x03: // MPEG1
+		case 0x04: // MPEG2
+		case 0x0F: // AAC
+		case 0x11: // AAC_LATM
+		case 0x81: // AC3
+		case 0x82: // DTS
+		case 0x83: // TRUEHD
+			//fprintf( stderr, "Audio   PID 0x%02X : %d\n", buf[c], epid);
+			if (s->anum < MAX_ANUM)
+				s->apid[s->anum++] = epid;
+			//fprintf(stderr, "  APID %04x", epid);
+			break;
+		case 0x06:
+			if (hasdesc(0x56, buf + c + 5, eslen))
+				s->ttx = epid;
+			else if (hasdesc(0x59, buf + c + 5, eslen))
+			        s->sub = epid;
+			else 
+			{
+				if (
+							(hasdesc(0x0a, buf + c + 5, eslen))
+						||	(hasdesc(0x6a, buf + c + 5, eslen))
+						||	(hasdesc(0x7a, buf + c + 5, eslen))
+					) 
+				{
+				if (s->anum < MAX_ANUM)
+					s->apid[s->anum++] = epid;
+				}
+			}
+			break;
+		case 0x05: // PRIVATE
+			//fprintf( stderr, "Private PID 0x%02X : %d\n", buf[c], epid);
+			break;
+		default:
+			//fprintf(" stderr, Unkown  PID 0x%02X : %d\n", buf[c], epid);
+			break;
+		}
+		c += 5;
+		c += eslen;
+		//if (eslen)
+		//	c+=get_desc(p, buf+c, eslen);
+	}
+	s->got_pmt = 1;
+	//fprintf(stderr, "\n");
+	return 0;
+
+}
+
+static int nit_cb(struct sfilter *sf)
+{
+    struct pid_info *p = sf->pidi;
+    struct scanip *sip = p->tsi->stp->sip;
+    uint8_t *buf = p->buf;
+    int slen, tsp, c;
+    uint16_t nid;
+    uint16_t ndl, tsll, tdl;
+    struct tp_info t;
+
+    slen = get12(buf + 1) + 3;
+    if (buf[1] & 0x80)
+        slen -= 4;
+    nid = get16(buf + 3);
+    ndl = get12(buf + 8);
+    tsp = 10 + ndl;
+    tsll = get12(buf + tsp);
+
+    if (p->tsi->stp->tpi->use_nit) {
+        for (c = tsp + 2; c < slen; c += tdl) {
+            memset(&t, 0, sizeof(struct tp_info));
+            t.tsid = get16(buf + c);
+            t.onid = get16(buf + c + 2);
+            t.nid = nid;
+            t.use_nit = p->tsi->stp->tpi->use_nit;
+            t.scan_eit = p->tsi->stp->tpi->scan_eit;
+            tdl = get12(buf + c + 4);
+            c += 6;
 
             switch (buf[c]) {
 			case 0x43:
@@ -1073,957 +2317,3056 @@ static int nit_cb(struct sfilter *sf)
 				t.src = p->tsi->stp->tpi->src;
 				add_tp(sip, &t);
 				break;
-			case 0x44:
-				{
-					uint32_t freq = getbcd(buf + c + 2, 8);
-					t.freq =  freq / 10000;
-					t.freq_frac =  freq % 10000;
+			case 0x44:
+				{
+					uint32_t freq = getbcd(buf + c + 2, 8);
+					t.freq =  freq / 10000;
+					t.freq_frac =  freq % 10000;
+				}
+				t.sr = getbcd(buf + c + 9, 7) / 10;
+				t.mod = buf[c + 8]; // undef 16 32 64 128 256
+				t.msys = 1;
+				t.type = 1;
+				//fprintf(stderr, " freq = %u  pos = %u  sr = %u  fec = %u  \n", freq, pos, sr, fec);
+				//fprintf(stderr, "freq=%u&msys=dvbc&mtype=%s\n", t.freq, mtype2str[t.mod]);
+
+				if( t.freq >= 50 && t.freq <= 1000 && t.sr >= 1000 && t.sr <= 7100 && t.mod >= 1 && t.mod <= 5 )
+					add_tp(sip, &t);
+				else {
+					fprintf(stderr, " *************************  freq = %u  sr = %u  mod = %u  \n", t.freq, t.sr, t.mod);
+					fprintf(stderr, " *************************  buffer start:\n" );
+					dump(buf, 32);
+					fprintf(stderr, " *************************  buffer position (c-32,c+16)  c = %d, slen = %d\n", c, slen);
+					dump(buf + c - 32, 48);
+				}
+			break;
+            case 0x83: // DVB-T Terrestrial Delivery System Descriptor
+                t.freq = getbcd(buf + c + 2, 8) / 100; // Częstotliwość w MHz
+                t.bw = (buf[c + 6] & 0xC0) >> 6;       // Szerokość pasma
+                t.tmode = (buf[c + 7] & 0xE0) >> 5;    // Tryb transmisji
+                t.gi = (buf[c + 7] & 0x1C) >> 2;      // Odstęp strażnika
+                t.msys = 3;                            // DVB-T
+                t.src = p->tsi->stp->tpi->src;
+                add_tp(sip, &t);
+                break;
+            case 0x87: // DVB-T2 (rozszerzenie, jeśli obsługiwane przez urządzenie)
+                t.freq = getbcd(buf + c + 2, 8) / 100; // Częstotliwość w MHz
+                t.bw = (buf[c + 6] & 0xC0) >> 6;       // Szerokość pasma
+                t.tmode = (buf[c + 7] & 0xE0) >> 5;    // Tryb transmisji (rozszerzony dla T2)
+                t.gi = (buf[c + 7] & 0x1C) >> 2;      // Odstęp strażnika
+                t.msys = 16;                           // DVB-T2
+                t.src = p->tsi->stp->tpi->src;
+                add_tp(sip, &t);
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+static int pat_cb(struct sfilter *sf)
+{
+    struct pid_info *p = sf->pidi;
+    struct scantp *stp = p->tsi->stp;
+    uint8_t *buf = p->buf;
+    int slen, c;
+    uint16_t pid, pnr;
+
+    slen = (((buf[1] & 0x03) << 8) | buf[2]) + 3;
+    sf->ext = ((buf[3] << 8) | buf[4]);
+    p->tsi->tsid = sf->ext;
+    if (!stp->pat_ms)
+        stp->pat_ms = ts_info_now(p->tsi) - stp->tune_start + 1;
+
+    fprintf(stderr, "PAT: TSID %04x, section length %d\n", p->tsi->tsid, slen);
+    for (c = 8; c < slen - 4; c += 4) {
+        pnr = (buf[c] << 8) | buf[c + 1];
+        pid = get_pid(buf + c + 2);
+        fprintf(stderr, " PNR %04x PID %04x\n", pnr, pid);
+        if (pnr) {
+            add_sfilter(p->tsi, pid, 0x02, pnr, 2, 60); // PMT, timeout 60s
+        } else if (p->tsi->stp->tpi->use_nit && pid != 0x10) {
+            add_sfilter(p->tsi, pid, 0x40, 0, 1, 120); // NIT, timeout 120s
+        }
+    }
+    return 0;
+}
+
+#define UTF8_CC_START 0xc2
+#define SB_CC_RESERVED_80 0x80
+#define SB_CC_RESERVED_81 0x81
+#define SB_CC_RESERVED_82 0x82
+#define SB_CC_RESERVED_83 0x83
+#define SB_CC_RESERVED_84 0x84
+#define SB_CC_RESERVED_85 0x85
+#define CHARACTER_EMPHASIS_ON 0x86
+#define CHARACTER_EMPHASIS_OFF 0x87
+#define SB_CC_RESERVED_88 0x88
+#define SB_CC_RESERVED_89 0x89
+#define CHARACTER_CR_LF 0x8a
+#define SB_CC_USER_8B 0x8b
+#define SB_CC_USER_9F 0x9f
+
+void en300468_parse_string_to_utf8(char *dest, uint8_t *src,
+		const unsigned int len)
+{
+	int utf8 = (src[0] == 0x15) ? 1 : 0;
+	int skip = (src[0] < 0x20) ? 1 : 0;
+	if( src[0] == 0x10 ) skip += 2;
+	uint16_t utf8_cc;
+	int dest_pos = 0;
+	int emphasis = 0;
+	int i;
+
+	for (i = skip; i < len; i++) {
+		switch(*(src + i)) {
+			case SB_CC_RESERVED_80 ... SB_CC_RESERVED_85:
+			case SB_CC_RESERVED_88 ... SB_CC_RESERVED_89:
+			case SB_CC_USER_8B ... SB_CC_USER_9F:
+			case CHARACTER_CR_LF:
+				dest[dest_pos++] = '\n';
+				continue;
+			case CHARACTER_EMPHASIS_ON:
+				emphasis = 1;
+				continue;
+			case CHARACTER_EMPHASIS_OFF:
+				emphasis = 0;
+				continue;
+			case UTF8_CC_START:
+				if (utf8 == 1) {
+					utf8_cc = *(src + i) << 8;
+					utf8_cc += *(src + i + 1);
+
+					switch(utf8_cc) {
+						case ((UTF8_CC_START << 8) | CHARACTER_EMPHASIS_ON):
+							emphasis = 1;
+							i++;
+							continue;
+						case ((UTF8_CC_START << 8) | CHARACTER_EMPHASIS_OFF):
+							emphasis = 0;
+							i++;
+							continue;
+						default:
+							break;
+					}
+				}
+			default: {
+				if (*(src + i) < 128)
+					dest[dest_pos++] = *(src + i);
+				else {
+					dest[dest_pos++] = 0xc2 + (*(src + i) > 0xbf);
+					dest[dest_pos++] = (*(src + i) & 0x3f) | 0x80;
+				}
+				break;
+			}
+		}
+	}
+	dest[dest_pos] = '\0';
+}
+
+static void sscopy(char *b, char *a, int len)
+{
+	while (len--) {
+		if (*a > 0x20 && (*a < 0x80 || *a > 0x9f))
+			*b++ = *a;
+		a++;
+	}
+	*b = 0;
+}
+
+
+static int sdt_cb(struct sfilter *sf)
+{
+	struct pid_info *p = sf->pidi;
+	uint8_t *buf=p->buf, tag;
+	int c, dll, dl, d, doff;
+	uint16_t onid, sid, tsid;
+	struct service *s;
+
+	tsid = get16(buf + 3);
+	onid = get16(buf + 8);
+	for (c = 11; c < p->len - 4; c += dll + 5) {
+		int spnl, snl;
+
+		sid = get16(buf + c);
+		dll = get12(buf + c + 3);
+
+		s = get_service(p->tsi->stp->tpi, sid);
+		s->onid = onid;
+		s->tsid = tsid;
+		s->eit_sched = ( buf[c + 2] & 0x02 ) >> 1;
+		s->eit_pf    = ( buf[c + 2] & 0x01 );
+		s->ca_mode   = ( buf[c + 3] & 0x10 ) >> 4;
+
+		if ( p->tsi->stp->tpi->scan_eit && s->eit_sched /*&& !s->ca_mode*/ ) {
+			int i;
+			for ( i = 0; i < MAX_EIT_SID; i++ ) {
+				if (p->tsi->stp->tpi->eit_sid[0] == 0 || p->tsi->stp->tpi->eit_sid[i] == sid) {
+					eit_services += 1;
+					add_sfilter(p->tsi, 0x12, 0x50, sid, 2, 15);
+					break;
+				}
+			}
+		}
+
+		//fprintf(stderr, "sid = %04x, dll = %u\n", sid, dll);
+		for (d = 0; d < dll; d += dl + 2) {
+			doff = c + d + 5;
+			tag = buf[doff];
+			dl = buf[doff + 1];
+			//fprintf(stderr, "desc %02x: %u\n", tag, dl);
+			if (tag == 0x48) {
+				spnl = buf[doff + 3];
+				snl = buf[doff + 4 + spnl];
+            s->pname[79] = 0x00;
+            s->name[79] = 0x00;
+				en300468_parse_string_to_utf8(s->pname, buf + doff + 4, spnl);
+            if( s->pname[79] != 0 )
+               fprintf(stderr, "********************************************* PNAME OVERFLOW spnl = %d",(int) spnl);
+				en300468_parse_string_to_utf8(s->name, buf + doff + 5 + spnl, snl);
+            if( s->name[79] != 0 )
+               fprintf(stderr, "********************************************* SNAME OVERFLOW snl = %d",(int) snl);
+				s->got_sdt = 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int eit_cb(struct sfilter *sf,int refresh)
+{
+	struct pid_info *p = sf->pidi;
+	uint8_t *buf=p->buf, tag;
+	uint16_t tid, onid, sid, tsid;
+	uint8_t snr, vnr, *name, *text;
+	int slen, dll, c, dl, d, doff, l, to, res;
+	uint16_t eid,mjd,teid;
+	struct service *s;
+	struct event e;
+
+	tid  = buf[0];
+	sid  = get16(buf + 3);
+	tsid = get16(buf + 8);
+	onid = get16(buf + 10);
+	vnr  = (buf[5] & 0x3f) >> 1;
+	snr  = buf[6];
+
+	slen = get12(buf + 1) + 3;
+	if (buf[1] & 0x80)
+		slen -= 4;
+
+	s = get_service(p->tsi->stp->tpi, sid);
+
+	if ( refresh )
+		fprintf(stderr,"eit_cb refresh %02X %u\n",tid,sid);
+	evstore_version(&s->evs, tid, vnr);
+
+	eit_size += slen;
+	eit_sections += 1;
+
+//	fprintf(stderr, "EIT %02x %d:%d:%d %d %d\n",tid,onid,tsid,sid,snr,slen);
+
+
+	for (c = 14; c < slen; c += dll + 12) {
+		memset(&e, 0, sizeof(struct event));
+		name = text = NULL;
+
+		e.tid = tid;
+		e.snr = snr;
+		e.ver = vnr;
+		e.sid = sid;
+		e.tsid = tsid;
+		e.onid = onid;
+		e.eid = get16(buf + c + 0);
+
+		e.mjd = get16(buf + c + 2);
+		e.sh = getbcd(buf + c + 4,2);
+		e.sm = getbcd(buf + c + 5,2);
+		e.ss = getbcd(buf + c + 6,2);
+		e.dh = getbcd(buf + c + 7,2);
+		e.dm = getbcd(buf + c + 8,2);
+		e.ds = getbcd(buf + c + 9,2);
+
+//		fprintf(stderr, "                Event %5d  %5d Start %02d:%02d:%02d Duration %02d:%02d:%02d\n",e.eid,e.mjd,e.sh,e.sm,e.ss,e.dh,e.dm,e.ds);
+		dll = get12(buf + c + 10);
+
+		//eit_shortsize += sizeof(struct event) + 16;
+
+		for (d = 0; d < dll; d += dl + 2) {
+			doff = c + d + 12;
+			tag = buf[doff];
+			dl = buf[doff + 1];
+			switch ( tag ) {
+				case 0x42: // Stuffing
+					break;
+				case 0x4A: // linkage
+				   if ( buf[doff+8] == 0x0D ) {
+						teid = get16(buf + doff + 9);
+						fprintf(stderr, "   LINK SID %5u EID %5u Tag %5u listet = %d, simul = %d\n"
+									        ,sid,e.eid,teid,(buf[doff + 11] & 0x80) >> 7, (buf[doff + 11] & 0x80) >> 6 );
+					} else
+						fprintf(stderr, "   LINK SID %5u EID %5u Type 0x%02X len %d\n",sid,e.eid,buf[doff+8],slen);
+					break;
+				case 0x4D: // short
+					if( dl >= 5 ) {
+						e.s_lang[0] = buf[doff + 2];
+						e.s_lang[1] = buf[doff + 3];
+						e.s_lang[2] = buf[doff + 4];
+						doff += 5;
+						l = buf[doff];
+						if (l > 0)
+							name = buf + doff;
+						eit_shortsize += l;
+						doff += l + 1;
+						l = buf[doff];
+						if (l > 0)
+							text = buf + doff;
+						eit_shortsize += l;
+					}
+					break;
+				case 0x4E: // extended
+					break;
+				case 0x4F: // time shift
+					break;
+				case 0x50: // component
+					break;
+				case 0x53: // CA
+					break;
+				case 0x54: // content
+					if (dl >= 2 && !e.content)
+						e.content = buf[doff + 2];
+					break;
+				case 0x55: // parental
+					break;
+				case 0x57: // telephone
+					break;
+				case 0x5E: // multilingual
+					break;
+				case 0x5F: // private data
+					break;
+				case 0x61: // short smoothing buffer
+					break;
+				case 0x64: // data broadcast
+					break;
+				case 0x69: // private data
+					break;
+				case 0x75: // TVA id
+					break;
+				case 0x76: // content identifier
+					break;
+				case 0x7D: // XAIT location
+					break;
+				case 0x7E: // FTA content managment
+					break;
+				case 0x7F: // extension
+					break;
+				default:
+					//fprintf(stderr, "   SID %5u EID %5u Tag %02x  len %d\n",sid,e.eid,tag,slen);
+					break;
+			}
+		}
+
+		res = evstore_upsert(&s->evs, &e, name, text);
+		if (res > 0)
+			eit_events += 1;
+		else if (!res)
+			eit_events_updated += 1;
+		if (res >= 0 && epg_fmt)
+			evstore_pend(&s->evs, &e);
+	}
+
+	/* a segment's last section also stands for the empty ones after it */
+	to = snr == buf[7] ? 0xff : snr == buf[12] ? snr | 7 : snr;
+	eit_events_deleted += evstore_expire(&s->evs, tid, vnr, snr, to);
+
+	return 0;
+}
+
+static int all_zero_8(uint32_t *p)
+{
+	return (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7]) ? 0 : 1;
+}
+
+static void epg_segment(struct tp_info *tpi, uint16_t sid, uint8_t tid, uint8_t seg);
+
+static int proc_sec(struct pid_info *p)
+{
+	uint8_t *buf=p->buf;
+	uint8_t snr, vnr, lsnr, tid;
+	struct sfilter *sf = NULL;
+	struct tp_info *tpi = p->tsi->stp->tpi;
+	uint16_t ext;
+	int i, res, eit;
+	int refresh;
+
+	tid = buf[0];
+	ext = ((buf[3] << 8) | buf[4]);
+	vnr = (buf[5] & 0x3f) >> 1;
+	snr = buf[6];
+	lsnr = buf[7];
+
+	if (!snr && p->tsi->now)
+		pid_info_seen(p, tid, ext, p->tsi->now);
+	if (p->add_ext)
+		sf = sfh_find(p, sfh_key(tid, ext, 1));
+	if (!sf) {
+		sf = sfh_find(p, sfh_key(tid, 0, 0));
+		if (!sf)
+			return -1;
+		if (p->add_ext) {
+			sfh_remove(p, sf);
+			sf->ext = ext;
+			sf->use_ext = 2;
+			sfh_insert(p, sf);
+		}
+	}
+	eit = tid >= EIT_TID0 && tid <= 0x6f;
+	if (eit)
+		tpi->epg_sections++;
+	refresh = 0;
+	if (!sf->vnr_set) {
+		sf->vnr = vnr;
+		sf->vnr_set = 1;
+	}
+	if (sf->vnr != vnr) {
+		if (eit)
+			tpi->epg_changes++;
+		fprintf(stderr, "TID %02x ext %u\n", tid, ext);
+		fprintf(stderr, "VNR change %u->%u\n", sf->vnr, vnr);
+
+		sf->todo_set = 0;
+		sf->vnr = vnr;
+		refresh = 1;
+		if (eit) {
+			get_service(tpi, ext)->evs.tdone[tid - EIT_TID0] = 0;
+			sfilter_reopen(sf, ts_info_now(p->tsi));
+		}
+	}
+	if (!sf->todo_set) {
+		for (i = 0; i <= lsnr; i++)
+			sf->todo[i >> 5] |= (1UL << (i & 31));
+		sf->todo_set = 1;
+
+		if (tid == 0x50 || tid == 0x60) {
+			uint8_t ltid = buf[13] & 0x0F;
+			for (i = 1; i <= ltid; i++) {
+				add_sfilter(p->tsi, 0x12, tid + i, sf->ext, 2, i < 2 ? 15 : 45);
+			}
+		}
+		/* the same version was complete on an earlier visit */
+		if (eit && get_service(tpi, ext)->evs.tdone[tid - EIT_TID0] == vnr + 1) {
+			memset(sf->todo, 0, sizeof(sf->todo));
+			sfilter_finish(sf);
+			return 0;
+		}
+	}
+	if ( sf->todo[snr >> 5] & (1UL << (snr & 31)) ) {
+		if (eit)
+			tpi->epg_parsed++;
+		if (!sf->seen && p->tsi->now) {
+			sf->seen = 1;
+			tcycle_wait(tpi, tid, p->tsi->now - sf->start);
+		}
+		switch (tid) {
+		case 0x00:
+			res = pat_cb(sf);
+			break;
+		case 0x02:
+			res = pmt_cb(sf);
+			break;
+		case 0x40:
+		case 0x41:
+			res = nit_cb(sf);
+			break;
+		case 0x42:
+		case 0x46:
+			res = sdt_cb(sf);
+			break;
+		default:
+			if (tid >= 0x4E && tid <= 0x6F)
+				res = eit_cb(sf, refresh);
+			else
+				res = -1;
+			break;
+		}
+		if (res == 0) {
+			sf->todo[snr >> 5] &= ~(1UL << (snr & 31));
+			if (tid >= 0x4E && tid <= 0x6F) {
+				uint8_t slsnr = buf[12];
+				for (i = slsnr + 1; i <= (slsnr | 7); i++)
+					sf->todo[i >> 5] &= ~(1UL << (i & 31));
+					//fprintf(stderr, "    %08x%08x%08x%08x%08x%08x%08x%08x\n",
+					//		sf->todo[7],sf->todo[6],sf->todo[5],sf->todo[4],sf->todo[3],sf->todo[2],sf->todo[1],sf->todo[0]);
+				/* segments are 8 aligned sections, all in one todo word */
+				if (epg_fmt && !((sf->todo[snr >> 5] >> (snr & 24)) & 0xff))
+					epg_segment(tpi, ext, tid, snr & 0xf8);
+			}
+			if (all_zero_8(sf->todo)) {
+				if (eit)
+					get_service(tpi, ext)->evs.tdone[tid - EIT_TID0] = vnr + 1;
+				sfilter_finish(sf);
+			} else
+				sfilter_set_timeout(sf, ts_info_now(p->tsi) + sfilter_timeout(sf));
+		}
+	}
+	return 0;
+}
+
+
+
+static struct {
+	uint64_t sections;	/* complete sections CRC checked and parsed */
+	uint64_t skip_done;	/* section number already collected */
+	uint64_t skip_nomatch;	/* no filter for table_id/extension */
+	uint64_t skip_next;	/* current_next_indicator 0 */
+} sec_stats;
+
+/*
+ * Can a section be dropped on its header alone, before it is copied
+ * and CRC checked? Mirrors the decisions of proc_sec(): no filter,
+ * not yet applicable, or a section number the filter already has in
+ * the same version.
+ */
+static int sec_skip(struct pid_info *p, const uint8_t *h)
+{
+	uint8_t tid = h[0], vnr = (h[5] & 0x3f) >> 1, snr = h[6];
+	uint16_t ext = (h[3] << 8) | h[4];
+	struct sfilter *sf = NULL;
+
+	if (!(h[1] & 0x80))
+		return 0;
+	if (!(h[5] & 1)) {
+		sec_stats.skip_next++;
+		return 1;
+	}
+	if (p->add_ext)
+		sf = sfh_find(p, sfh_key(tid, ext, 1));
+	if (!sf && !(sf = sfh_find(p, sfh_key(tid, 0, 0)))) {
+		if (!snr && p->tsi->now)
+			pid_info_seen(p, tid, ext, p->tsi->now);
+		sec_stats.skip_nomatch++;
+		return 1;
+	}
+	if (!sf->vnr_set || sf->vnr != vnr || !sf->todo_set ||
+	    (sf->todo[snr >> 5] & (1UL << (snr & 31))))
+		return 0;
+	if (!snr && p->tsi->now)
+		pid_info_seen(p, tid, ext, p->tsi->now);
+	if (tid >= EIT_TID0 && tid <= 0x6f)
+		p->tsi->stp->tpi->epg_sections++;
+	sec_stats.skip_done++;
+	return 1;
+}
+
+static void sec_print_stats(void)
+{
+	fprintf(stderr, "Sections: %llu parsed, %llu skipped on the header (%llu collected, %llu unmatched, %llu not current)\n",
+		(unsigned long long) sec_stats.sections,
+		(unsigned long long) (sec_stats.skip_done + sec_stats.skip_nomatch + sec_stats.skip_next),
+		(unsigned long long) sec_stats.skip_done,
+		(unsigned long long) sec_stats.skip_nomatch,
+		(unsigned long long) sec_stats.skip_next);
+}
+
+static int pid_info_proc_section(struct pid_info *p)
+{
+	uint8_t *buf = p->buf;
+
+	if (p->bufp != p->len) {
+		if (p->len && p->bufp > p->len)
+			goto exit;
+		return 0;
+	}
+	if (p->skip)
+		goto exit;
+	sec_stats.sections++;
+	if (buf[1] & 0x80) {
+		if (dvb_crc32(buf, p->len)) {
+			fprintf(stderr, "CRC error pid %04x!\n", p->pid);
+			goto exit;
+		}
+	}
+
+	//fprintf(stderr, "PID %04x SEC[%d]: %02x\n", (int) p->pid, p->len, (int)p->buf[0]);
+	if (p->len < 8)
+		return 0;
+	if (!(buf[5] & 1))
+		return 0;
+
+	/* sections of completed (reclaimed) filters are simply not matched */
+	proc_sec(p);
+exit:
+	pid_info_reset(p);
+	return 0;
+}
+
+/****************************************************************************/
+/****************************************************************************/
+
+/* make room for a section of p->len bytes, the buffer is allocated on demand */
+static int pid_info_fit(struct pid_info *p)
+{
+	uint8_t *buf;
+	int large = p->len > SECBUF_SMALL;
+
+	if (p->len > SECBUF_LARGE)
+		return -1;
+	if (p->skip || (p->buf && p->len <= p->bufsize))
+		return 0;
+	if (!(buf = secbuf_get(large)))
+		return -1;
+	if (p->buf) {
+		memcpy(buf, p->buf, p->bufp);
+		secbuf_put(p->buf, 0);
+		secbuf_stats.upgrades++;
+	}
+	p->buf = buf;
+	p->bufsize = large ? SECBUF_LARGE : SECBUF_SMALL;
+	return 0;
+}
+
+static inline void write_secbuf(struct pid_info *p, uint8_t *tsp, int n)
+{
+	if (!p->skip)
+		memcpy(p->buf+p->bufp, tsp, n);
+	p->bufp += n;
+}
+
+
+static inline int validcc(struct pid_info *p, uint8_t *tsp)
+{
+	uint8_t newcc;
+	int valid;
+
+	newcc = tsp[3] & 0x0f;
+        valid = (((p->cc + 1) & 0x0f) == newcc) ? 1 : 0;
+	if (p->cc == 0xff)
+		valid=1;
+        p->cc = newcc;
+	if (!valid) {
+		fprintf(stderr, "CC error PID %04x!\n", p->pid);
+		pid_info_reset(p);
+	}
+	return valid;
+}
+
+static inline int pid_info_build_section(struct pid_info *p, uint8_t *tsp)
+{
+        int pusoff, todo = tspayload(tsp), i = 188 - todo;
+
+        if (!todo)
+                return -1;
+	pusoff = (tsp[1] & 0x40) ? tsp[i++] : todo;
+	if (pusoff + i > 188)
+		goto error;
+	if (validcc(p, tsp) && pusoff && p->bufp) {
+	        int rlen = pusoff;
+		if (p->len) {
+			if (p->bufp + rlen > p->len)
+				rlen = p->len - p->bufp;
+		} else
+			if (p->bufp + rlen > p->bufsize)
+				rlen = p->bufsize - p->bufp;
+		write_secbuf(p, tsp + i, rlen);
+		if (!p->len && p->bufp >= 3)
+			p->len = seclen(p->buf);
+		if (pid_info_fit(p) < 0)
+			pid_info_reset(p);
+		else
+			pid_info_proc_section(p);
+	}
+	i += pusoff;
+	while ((todo = 188 - i) > 0 && tsp[i] != 0xff) {
+	        pid_info_reset(p);
+		if (todo < 3)
+			fprintf(stderr, "sec start <3 \n");
+		if (todo >= 8 && (p->len = seclen(tsp+i)) >= 8 && sec_skip(p, tsp+i)) {
+			if (p->len > todo) {
+				p->skip = 1;
+				p->bufp = todo;
+				i += todo;
+			} else {
+				i += p->len;
+				pid_info_reset(p);
+			}
+		} else if (todo < 3 || (p->len = seclen(tsp+i)) > todo) {
+			if (pid_info_fit(p) < 0)
+				goto error;
+			write_secbuf(p, tsp+i, todo);
+			i+=todo;
+		} else if (sec_inplace) {
+			/* whole section in this packet, parse it where it is */
+			uint8_t *buf = p->buf;
+
+			p->buf = tsp + i;
+			p->bufp = p->len;
+			i += p->len;
+			pid_info_proc_section(p);
+			p->buf = buf;
+		} else {
+			if (pid_info_fit(p) < 0)
+				goto error;
+			write_secbuf(p, tsp+i, p->len);
+			i+=p->len;
+			pid_info_proc_section(p);
+		}
+	}
+	return 0;
+
+error:
+	fprintf(stderr, "error\n");
+	pid_info_reset(p);
+	return -1;
+}
+
+/****************************************************************************/
+
+void proc_tsp(struct ts_info *tsi, uint8_t *tsp)
+{
+        uint16_t pid = 0x1fff & ((tsp[1] << 8) | tsp[2]);
+	struct pid_info *pidi = pid_lookup(tsi, pid);
+
+	if (!pidi || !pidi->active)
+		return;
+
+	pid_info_build_section(pidi, tsp);
+	/* all filters done, give the buffer back for other PIDs */
+	if (!pidi->active && pidi->buf) {
+		secbuf_put(pidi->buf, pidi->bufsize == SECBUF_LARGE);
+		pidi->buf = NULL;
+	}
+}
+
+/*
+ * Finish the filters whose deadline has passed, earliest first. Called
+ * from the event loop; only a safety net for tables that never complete.
+ */
+static void ts_info_check_filters(struct ts_info *tsi, int64_t mt)
+{
+    struct sfilter *sf;
+
+    while (tsi->heap_len && mt >= tsi->heap[0]->timeout) {
+        sf = tsi->heap[0];
+        fprintf(stderr, "Timeout exceeded for filter PID=%u TID=%u EXT=%u (todo_set=%d)\n",
+                sf->pidi->pid, sf->tid, sf->ext, sf->todo_set);
+        sfilter_finish(sf);
+    }
+}
+
+void proc_tsps(struct ts_info *tsi, uint8_t *tsp, uint32_t len)
+{
+    while (len >= 188) {
+        proc_tsp(tsi, tsp);
+        tsp += 188;
+        len -= 188;
+    }
+}
+
+/****************************************************************************/
+/****************************************************************************/
+// Valid till 28.2.2100
+static void get_date_from_mjd(uint16_t mjd, uint16_t *y, uint8_t *m, uint8_t *d)
+{
+	static int dm[] = {31,30,31,30,31,31,30,31,30,31,31,28};
+	int i,p,r;
+	r = mjd - 51604;  // 0 = 1.3.2000
+	if (r < 0)
+		r += 65536;
+	p = r / (365*4+1);
+	r = r - p * (365*4+1);
+	*y = p * 4 + 2000;
+	p = r / 365;
+	r = r - p * 365;
+	//~ fprintf(stderr, " %d,%d\n",p,r);
+	*y += p;
+	if (p < 4) {
+		for (i = 0; i < 12; i += 1) {
+			*m = i < 10 ? i + 3 : i - 9;
+			if (r < dm[i]) {
+				*d = r + 1;
+				if ( i >= 10 )
+					*y += 1;
+				break;
+			}
+			r -= dm[i];
+		}
+	} else {
+		*m = 2;
+		*d = 29;
+	}
+}
+
+static void print_events(struct tp_info *tpi)
+{
+	struct service *s;
+	struct event *e;
+	uint8_t *str;
+	char t[512];
+	int i;
+	uint16_t y;
+	uint8_t m,d;
+
+
+	list_for_each_entry(s, &tpi->services, link) {
+		for (e = s->evs.ev; e < s->evs.ev + s->evs.nev; e++) {
+			if (e->ver == EV_DELETED)
+				continue;
+			printf("EVENT\n");
+			printf(" ID:%d:%d:%d:%d\n", e->onid, e->tsid, e->sid, e->eid);
+			get_date_from_mjd(e->mjd,&y,&m,&d);
+			printf(" TIME:%04d-%02d-%02dT%02d:%02d:%02dZ\n", y, m, d, e->sh, e->sm, e->ss);
+			printf(" DUR:%02d:%02d:%02d\n", e->dh, e->dm, e->ds);
+			for ( i = 0; i < 3; i += 1) {
+				if( e->s_lang[i] < 0x20 || e->s_lang[i] >= 0x7F )
+					 e->s_lang[i] = '?';
+			}
+			printf(" LANG:%c%c%c\n", e->s_lang[0], e->s_lang[1], e->s_lang[2]);
+			if( e->s_name ) {
+				str = s->evs.str + e->s_name;
+				en300468_parse_string_to_utf8(t,&str[1],str[0]);
+				printf(" NAME:%s\n",t);
+			}
+			if( e->s_text ) {
+				str = s->evs.str + e->s_text;
+				en300468_parse_string_to_utf8(t,&str[1],str[0]);
+				printf(" TEXT:%s\n",t);
+			}
+			printf("END\n");
+		}
+	}
+}
+
+
+
+/****************************************************************************/
+/*
+ * Streaming EPG output (--epg=xmltv|jsonl[:<file>]). An EIT segment is
+ * written as soon as all its sections are in, see proc_sec(), through
+ * a buffer that goes out with write(2) at the end of each segment. A
+ * table that changes version is written again as its segments complete.
+ *
+ * XMLTV wants all <channel> elements before the programmes, which a
+ * stream cannot know up front; each channel is written just before its
+ * first programme instead.
+ */
+
+static uint64_t epg_events;
+static uint64_t epg_writes;
+
+struct outbuf {
+	int fd;
+	int len;
+	char buf[65536];
+};
+
+static struct outbuf epg_out = { .fd = 1 };
+
+static void ob_flush(struct outbuf *ob)
+{
+	int n, off = 0;
+
+	while (off < ob->len) {
+		n = write(ob->fd, ob->buf + off, ob->len - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		off += n;
+		epg_writes++;
+	}
+	ob->len = 0;
+}
+
+static void ob_write(struct outbuf *ob, const char *s, int n)
+{
+	if (ob->len + n > sizeof(ob->buf))
+		ob_flush(ob);
+	if (n > sizeof(ob->buf))
+		n = sizeof(ob->buf);
+	memcpy(ob->buf + ob->len, s, n);
+	ob->len += n;
+}
+
+static void ob_printf(struct outbuf *ob, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(ob->buf + ob->len, sizeof(ob->buf) - ob->len, fmt, ap);
+	va_end(ap);
+	if (n >= 0 && n < sizeof(ob->buf) - ob->len) {
+		ob->len += n;
+		return;
+	}
+	ob_flush(ob);
+	va_start(ap, fmt);
+	n = vsnprintf(ob->buf, sizeof(ob->buf), fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		ob->len = n < sizeof(ob->buf) ? n : sizeof(ob->buf) - 1;
+}
+
+/* UTF-8 text as XML character data or the inside of a JSON string */
+static void ob_text(struct outbuf *ob, const char *s)
+{
+	const char *r;
+	char esc[8];
+	int n;
+
+	for (; *s; s += n) {
+		for (n = 0; s[n] && (uint8_t) s[n] >= 0x20 && !strchr(epg_fmt == EPG_XMLTV ?
+		     "&<>\"" : "\"\\", s[n]); n++)
+			;
+		if (n) {
+			ob_write(ob, s, n);
+			continue;
+		}
+		n = 1;
+		r = NULL;
+		switch (*s) {
+		case '&':  r = "&amp;"; break;
+		case '<':  r = "&lt;"; break;
+		case '>':  r = "&gt;"; break;
+		case '"':  r = epg_fmt == EPG_XMLTV ? "&quot;" : "\\\""; break;
+		case '\\': r = "\\\\"; break;
+		case '\t': r = epg_fmt == EPG_XMLTV ? "\t" : "\\t"; break;
+		case '\n': r = epg_fmt == EPG_XMLTV ? "\n" : "\\n"; break;
+		/* a literal CR would become LF in an XML parser */
+		case '\r': r = epg_fmt == EPG_XMLTV ? "&#13;" : "\\r"; break;
+		default:
+			/* other control characters are not allowed in XML */
+			if (epg_fmt == EPG_JSONL) {
+				snprintf(esc, sizeof(esc), "\\u%04x", (uint8_t) *s);
+				r = esc;
+			}
+			break;
+		}
+		if (r)
+			ob_write(ob, r, strlen(r));
+	}
+}
+
+static time_t event_start(struct event *e)
+{
+	return (time_t) (e->mjd - 40587) * 86400 + e->sh * 3600 + e->sm * 60 + e->ss;
+}
+
+static int event_duration(struct event *e)
+{
+	return e->dh * 3600 + e->dm * 60 + e->ds;
+}
+
+static void epg_time(char *t, int tlen, time_t tt)
+{
+	struct tm tm;
+
+	gmtime_r(&tt, &tm);
+	strftime(t, tlen, epg_fmt == EPG_XMLTV ? "%Y%m%d%H%M%S +0000" :
+		 "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static void epg_event(struct service *s, struct event *e)
+{
+	struct outbuf *ob = &epg_out;
+	char start[32], stop[32], lang[4], t[512];
+	time_t tt;
+	int i;
+
+	tt = event_start(e);
+	epg_time(start, sizeof(start), tt);
+	epg_time(stop, sizeof(stop), tt + event_duration(e));
+	for (i = 0; i < 3; i++)
+		lang[i] = e->s_lang[i] < 0x20 || e->s_lang[i] >= 0x7f ? '?' : e->s_lang[i];
+	lang[3] = 0;
+
+	if (epg_fmt == EPG_XMLTV) {
+		if (!s->epg_chan) {
+			s->epg_chan = 1;
+			ob_printf(ob, "<channel id=\"%u.%u.%u\">\n  <display-name>",
+				  e->onid, e->tsid, e->sid);
+			ob_text(ob, s->name);
+			ob_printf(ob, "</display-name>\n</channel>\n");
+		}
+		ob_printf(ob, "<programme start=\"%s\" stop=\"%s\" channel=\"%u.%u.%u\">\n",
+			  start, stop, e->onid, e->tsid, e->sid);
+		if (e->s_name) {
+			en300468_parse_string_to_utf8(t, s->evs.str + e->s_name + 1,
+						      s->evs.str[e->s_name]);
+			ob_printf(ob, "  <title lang=\"%s\">", lang);
+			ob_text(ob, t);
+			ob_printf(ob, "</title>\n");
+		}
+		if (e->s_text) {
+			en300468_parse_string_to_utf8(t, s->evs.str + e->s_text + 1,
+						      s->evs.str[e->s_text]);
+			ob_printf(ob, "  <desc lang=\"%s\">", lang);
+			ob_text(ob, t);
+			ob_printf(ob, "</desc>\n");
+		}
+		ob_printf(ob, "</programme>\n");
+	} else {
+		ob_printf(ob, "{\"channel\":\"%u.%u.%u\",\"service\":\"",
+			  e->onid, e->tsid, e->sid);
+		ob_text(ob, s->name);
+		ob_printf(ob, "\",\"event_id\":%u,\"table_id\":%u,\"version\":%u,"
+			  "\"start\":\"%s\",\"stop\":\"%s\",\"lang\":\"%s\"",
+			  e->eid, e->tid, e->ver, start, stop, lang);
+		if (e->s_name) {
+			en300468_parse_string_to_utf8(t, s->evs.str + e->s_name + 1,
+						      s->evs.str[e->s_name]);
+			ob_printf(ob, ",\"title\":\"");
+			ob_text(ob, t);
+			ob_printf(ob, "\"");
+		}
+		if (e->s_text) {
+			en300468_parse_string_to_utf8(t, s->evs.str + e->s_text + 1,
+						      s->evs.str[e->s_text]);
+			ob_printf(ob, ",\"desc\":\"");
+			ob_text(ob, t);
+			ob_printf(ob, "\"");
+		}
+		ob_printf(ob, "}\n");
+	}
+	epg_events++;
+}
+
+/*
+ * All sections of the segment starting at seg of table tid are in.
+ * Its events are the pending ones of that segment, found through the
+ * index, so a schedule is not walked again for every segment.
+ */
+static void epg_segment(struct tp_info *tpi, uint16_t sid, uint8_t tid, uint8_t seg)
+{
+	struct service *s = get_service(tpi, sid);
+	struct evstore *es = &s->evs;
+	struct evpend *p;
+	struct event *e;
+	uint32_t i, r, n = 0;
+
+	for (i = 0; i < es->npend; i++) {
+		p = &es->pend[i];
+		if (p->tid != tid || p->snr < seg || p->snr > (seg | 7)) {
+			es->pend[n++] = *p;
+			continue;
+		}
+		r = es->idx[evstore_slot(es, p->eid, p->tid)];
+		e = r ? &es->ev[r - 1] : NULL;
+		if (e && e->ver != EV_DELETED)
+			epg_event(s, e);
+	}
+	es->npend = n;
+	ob_flush(&epg_out);
+}
+
+static int epg_open(const char *arg)
+{
+	const char *file = strchr(arg, ':');
+	int n = file ? file - arg : strlen(arg);
+
+	if (n == 5 && !strncmp(arg, "xmltv", 5))
+		epg_fmt = EPG_XMLTV;
+	else if (n == 5 && !strncmp(arg, "jsonl", 5))
+		epg_fmt = EPG_JSONL;
+	else
+		return -1;
+	if (file && file[1]) {
+		epg_out.fd = open(file + 1, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (epg_out.fd < 0) {
+			perror(file + 1);
+			return -1;
+		}
+	}
+	if (epg_fmt == EPG_XMLTV)
+		ob_printf(&epg_out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			  "<!DOCTYPE tv SYSTEM \"xmltv.dtd\">\n"
+			  "<tv generator-info-name=\"octoscan\">\n");
+	return 0;
+}
+
+static void epg_close(void)
+{
+	if (epg_fmt == EPG_NONE)
+		return;
+	if (epg_fmt == EPG_XMLTV)
+		ob_printf(&epg_out, "</tv>\n");
+	ob_flush(&epg_out);
+	if (epg_out.fd != 1)
+		close(epg_out.fd);
+	fprintf(stderr, "EPG: %llu events written with %llu writes\n",
+		(unsigned long long) epg_events, (unsigned long long) epg_writes);
+}
+
+/****************************************************************************/
+/*
+ * --epgdb=<file>: the event stores of all transponders as an epgdb.h
+ * database, written at the end of a scan and, with --daemon, every
+ * EPGDB_MS while the stores change. Every write is a new generation that
+ * replaces the file by rename(2).
+ *
+ * The records of a service are built when its store has changed and
+ * kept in an epgdb_cache with the texts already converted, so a write
+ * only puts the caches together. A daemon does that in a forked child:
+ * assembling and syncing a large database never holds up the sessions.
+ */
+
+#define EPGDB_MS 10000
+
+static const char *epgdb_path;
+static uint32_t epgdb_gen;
+static int64_t epgdb_written = -1;	/* eit_changes at the last write */
+static pid_t epgdb_child;		/* writing a generation, --daemon */
+static uint32_t epgdb_child_changes;	/* eit_changes it was started at */
+
+struct epgdb_ref {
+	uint64_t key;		/* onid, tsid, sid */
+	int64_t start;
+	struct service *s;
+	struct event *e;
+};
+
+struct epgdb_build {
+	struct epgdb_ref *refs;
+	int nrefs;
+	int rsize;
+	char *str;
+	uint32_t slen;
+	uint32_t ssize;
+	uint32_t *hash;		/* string offsets, 0 is empty */
+	uint32_t hsize;		/* power of 2, at least twice nstr */
+	uint32_t nstr;
+};
+
+/* the events of one database service within an epgdb_cache */
+struct epgdb_run {
+	uint64_t key;		/* onid, tsid, sid */
+	uint32_t first;
+	uint32_t count;
+};
+
+struct epgdb_cache {
+	uint32_t changes;	/* evstore.changes it was built at */
+	struct epgdb_run *run;
+	uint32_t nrun;
+	struct epgdb_event *ev;	/* texts are offsets into str */
+	uint32_t nev;
+	char *str;		/* 0 is the empty string */
+	uint32_t slen;
+	uint32_t nstr;
+};
+
+/* a run on its way into the file */
+struct epgdb_part {
+	const struct epgdb_run *run;
+	const struct epgdb_cache *c;
+	struct service *s;
+	uint32_t base;		/* added to the text offsets of c */
+};
+
+static uint32_t epgdb_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (uint8_t) *s++) * 16777619;
+	return h;
+}
+
+/* offset of s in the string section, each text is stored once */
+static uint32_t epgdb_intern(struct epgdb_build *b, const char *s)
+{
+	uint32_t i, *h, len = strlen(s) + 1;
+	char *str;
+
+	if (len == 1)
+		return 0;
+	if (2 * (b->nstr + 1) > b->hsize) {
+		h = calloc(b->hsize ? 2 * b->hsize : 1024, sizeof(*h));
+		if (!h)
+			return 0;
+		for (i = 0; i < b->hsize; i++) {
+			uint32_t j, off = b->hash[i];
+
+			if (!off)
+				continue;
+			for (j = epgdb_hash(b->str + off); h[j & (2 * b->hsize - 1)]; j++)
+				;
+			h[j & (2 * b->hsize - 1)] = off;
+		}
+		free(b->hash);
+		b->hash = h;
+		b->hsize = b->hsize ? 2 * b->hsize : 1024;
+	}
+	for (i = epgdb_hash(s) & (b->hsize - 1); b->hash[i]; i = (i + 1) & (b->hsize - 1))
+		if (!strcmp(b->str + b->hash[i], s))
+			return b->hash[i];
+	if (b->slen + len > b->ssize) {
+		str = realloc(b->str, 2 * (b->slen + len));
+		if (!str)
+			return 0;
+		b->str = str;
+		b->ssize = 2 * (b->slen + len);
+	}
+	memcpy(b->str + b->slen, s, len);
+	b->hash[i] = b->slen;
+	b->slen += len;
+	b->nstr++;
+	return b->hash[i];
+}
+
+static uint32_t epgdb_text(struct epgdb_build *b, struct service *s, uint32_t off)
+{
+	char t[512];
+
+	if (!off)
+		return 0;
+	en300468_parse_string_to_utf8(t, s->evs.str + off + 1, s->evs.str[off]);
+	return epgdb_intern(b, t);
+}
+
+static int epgdb_ref_add(struct epgdb_build *b, struct service *s, struct event *e)
+{
+	struct epgdb_ref *r;
+
+	if (b->nrefs == b->rsize) {
+		r = realloc(b->refs, (b->rsize ? 2 * b->rsize : 4096) * sizeof(*r));
+		if (!r)
+			return -1;
+		b->refs = r;
+		b->rsize = b->rsize ? 2 * b->rsize : 4096;
+	}
+	r = &b->refs[b->nrefs++];
+	r->key = (uint64_t) e->onid << 32 | (uint32_t) e->tsid << 16 | e->sid;
+	r->start = event_start(e);
+	r->s = s;
+	r->e = e;
+	return 0;
+}
+
+/* by service, start and table, so present/following wins over schedule */
+static int epgdb_ref_cmp(const void *pa, const void *pb)
+{
+	const struct epgdb_ref *a = pa, *b = pb;
+
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	if (a->start != b->start)
+		return a->start < b->start ? -1 : 1;
+	return (int) a->e->tid - (int) b->e->tid;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void epgdb_cache_free(struct epgdb_cache *c)
+{
+	if (!c)
+		return;
+	free(c->run);
+	free(c->ev);
+	free(c->str);
+	free(c);
+}
+
+/* the records of s by database service and start, NULL if out of memory */
+static struct epgdb_cache *epgdb_cache_build(struct service *s)
+{
+	struct epgdb_build b = { 0 };
+	struct epgdb_cache *c;
+	struct epgdb_event *ee;
+	struct epgdb_run *run = NULL;
+	struct epgdb_ref *r;
+	struct event *e;
+
+	c = calloc(1, sizeof(*c));
+	b.slen = b.ssize = 1;
+	b.str = calloc(1, 1);
+	if (!c || !b.str)
+		goto fail;
+	for (e = s->evs.ev; e < s->evs.ev + s->evs.nev; e++)
+		if (e->ver != EV_DELETED && epgdb_ref_add(&b, s, e) < 0)
+			goto fail;
+	qsort(b.refs, b.nrefs, sizeof(*b.refs), epgdb_ref_cmp);
+
+	c->run = calloc(b.nrefs + 1, sizeof(*c->run));
+	c->ev = calloc(b.nrefs + 1, sizeof(*c->ev));
+	if (!c->run || !c->ev)
+		goto fail;
+	for (r = b.refs; r < b.refs + b.nrefs; r++) {
+		e = r->e;
+		if (r == b.refs || r->key != r[-1].key) {
+			run = &c->run[c->nrun++];
+			run->key = r->key;
+			run->first = c->nev;
+		} else if (r->start == r[-1].start && e->eid == r[-1].e->eid) {
+			/* the same event from another table */
+			continue;
+		}
+		ee = &c->ev[c->nev++];
+		run->count++;
+		ee->start = r->start;
+		ee->duration = event_duration(e);
+		ee->title = epgdb_text(&b, s, e->s_name);
+		ee->text = epgdb_text(&b, s, e->s_text);
+		ee->event_id = e->eid;
+		ee->table_id = e->tid;
+		ee->content = e->content;
+		memcpy(ee->lang, e->s_lang, 3);
+	}
+	c->changes = s->evs.changes;
+	c->str = b.str;
+	c->slen = b.slen;
+	c->nstr = b.nstr;
+	free(b.refs);
+	free(b.hash);
+	return c;
+fail:
+	free(b.refs);
+	free(b.str);
+	free(b.hash);
+	epgdb_cache_free(c);
+	return NULL;
+}
+
+/* rebuild the caches of the services that changed, how many or -1 */
+static int epgdb_update(struct scanip *sips, int nsips)
+{
+	struct list_head *lists[2];
+	struct epgdb_cache *c;
+	struct tp_info *tpi;
+	struct service *s;
+	int i, j, n = 0;
+
+	for (i = 0; i < nsips; i++) {
+		lists[0] = &sips[i].tps_done;
+		lists[1] = &sips[i].tps;
+		for (j = 0; j < 2; j++)
+			list_for_each_entry(tpi, lists[j], link)
+				list_for_each_entry(s, &tpi->services, link) {
+					if (s->dbc && s->dbc->changes == s->evs.changes)
+						continue;
+					c = epgdb_cache_build(s);
+					if (!c)
+						return -1;
+					epgdb_cache_free(s->dbc);
+					s->dbc = c;
+					n++;
 				}
-				t.sr = getbcd(buf + c + 9, 7) / 10;
-				t.mod = buf[c + 8]; // undef 16 32 64 128 256
-				t.msys = 1;
-				t.type = 1;
-				//fprintf(stderr, " freq = %u  pos = %u  sr = %u  fec = %u  \n", freq, pos, sr, fec);
-				//fprintf(stderr, "freq=%u&msys=dvbc&mtype=%s\n", t.freq, mtype2str[t.mod]);
+	}
+	return n;
+}
 
-				if( t.freq >= 50 && t.freq <= 1000 && t.sr >= 1000 && t.sr <= 7100 && t.mod >= 1 && t.mod <= 5 )
-					add_tp(sip, &t);
-				else {
-					fprintf(stderr, " *************************  freq = %u  sr = %u  mod = %u  \n", t.freq, t.sr, t.mod);
-					fprintf(stderr, " *************************  buffer start:\n" );
-					dump(buf, 32);
-					fprintf(stderr, " *************************  buffer position (c-32,c+16)  c = %d, slen = %d\n", c, slen);
-					dump(buf + c - 32, 48);
+/* by service, so the runs of one go out together */
+static int epgdb_part_cmp(const void *pa, const void *pb)
+{
+	const struct epgdb_part *a = pa, *b = pb;
+
+	if (a->run->key != b->run->key)
+		return a->run->key < b->run->key ? -1 : 1;
+	return 0;
+}
+
+static void epgdb_put(struct epgdb_event *d, const struct epgdb_part *p, uint32_t i)
+{
+	*d = p->c->ev[p->run->first + i];
+	if (d->title)
+		d->title += p->base;
+	if (d->text)
+		d->text += p->base;
+}
+
+/*
+ * The events of the runs of one service, merged by start and table. A
+ * service in more than one store has its events from several tables,
+ * present/following wins over schedule as in epgdb_cache_build().
+ */
+static uint32_t epgdb_merge(struct epgdb_event *ev, const struct epgdb_part *p,
+			    int np, uint32_t *pos)
+{
+	const struct epgdb_event *e, *best;
+	uint32_t n = 0;
+	int i, k;
+
+	if (np == 1) {
+		for (n = 0; n < p->run->count; n++)
+			epgdb_put(&ev[n], p, n);
+		return n;
+	}
+	memset(pos, 0, np * sizeof(*pos));
+	while (1) {
+		best = NULL;
+		for (i = 0, k = -1; i < np; i++) {
+			if (pos[i] == p[i].run->count)
+				continue;
+			e = &p[i].c->ev[p[i].run->first + pos[i]];
+			if (!best || e->start < best->start ||
+			    (e->start == best->start && e->table_id < best->table_id)) {
+				best = e;
+				k = i;
+			}
+		}
+		if (!best)
+			return n;
+		if (!n || best->start != ev[n - 1].start || best->event_id != ev[n - 1].event_id)
+			epgdb_put(&ev[n++], &p[k], pos[k]);
+		pos[k]++;
+	}
+}
+
+/* so the new name of the file survives a crash */
+static int fsync_dir(const char *path)
+{
+	char dir[MAX_PATH];
+	char *p;
+	int fd, res;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	p = strrchr(dir, '/');
+	if (!p)
+		strcpy(dir, ".");
+	else
+		p[p == dir] = 0;
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -1;
+	res = fsync(fd);
+	close(fd);
+	return res;
+}
+
+/* put the caches together as generation gen, rebuilt is for the log */
+static int epgdb_save(struct scanip *sips, int nsips, uint32_t gen, int rebuilt)
+{
+	struct epgdb_header h = { { 0 } };
+	struct epgdb_service *svc = NULL, *sv;
+	struct epgdb_event *ev = NULL;
+	struct epgdb_part *part = NULL, *p, *q;
+	struct list_head *lists[2];
+	struct tp_info *tpi;
+	struct service *s;
+	char tmp[MAX_PATH + 8], *str = NULL;
+	uint32_t nsvc = 0, nev = 0, nstr = 0, slen = 1, *pos = NULL, k;
+	int64_t t0 = mtime_ms();
+	int i, j, np = 0, fd = -1, res = -1;
+
+	for (i = 0; i < nsips; i++) {
+		lists[0] = &sips[i].tps_done;
+		lists[1] = &sips[i].tps;
+		for (j = 0; j < 2; j++)
+			list_for_each_entry(tpi, lists[j], link)
+				list_for_each_entry(s, &tpi->services, link) {
+					if (!s->dbc)
+						continue;
+					np += s->dbc->nrun;
+					nev += s->dbc->nev;
+					slen += s->dbc->slen - 1 + strlen(s->name) + 1;
 				}
-			break;
-            case 0x83: // DVB-T Terrestrial Delivery System Descriptor
-                t.freq = getbcd(buf + c + 2, 8) / 100; // Częstotliwość w MHz
-                t.bw = (buf[c + 6] & 0xC0) >> 6;       // Szerokość pasma
-                t.tmode = (buf[c + 7] & 0xE0) >> 5;    // Tryb transmisji
-                t.gi = (buf[c + 7] & 0x1C) >> 2;      // Odstęp strażnika
-                t.msys = 3;                            // DVB-T
-                t.src = p->tsi->stp->tpi->src;
-                add_tp(sip, &t);
-                break;
-            case 0x87: // DVB-T2 (rozszerzenie, jeśli obsługiwane przez urządzenie)
-                t.freq = getbcd(buf + c + 2, 8) / 100; // Częstotliwość w MHz
-                t.bw = (buf[c + 6] & 0xC0) >> 6;       // Szerokość pasma
-                t.tmode = (buf[c + 7] & 0xE0) >> 5;    // Tryb transmisji (rozszerzony dla T2)
-                t.gi = (buf[c + 7] & 0x1C) >> 2;      // Odstęp strażnika
-                t.msys = 16;                           // DVB-T2
-                t.src = p->tsi->stp->tpi->src;
-                add_tp(sip, &t);
-                break;
+	}
+	part = calloc(np + 1, sizeof(*part));
+	pos = calloc(np + 1, sizeof(*pos));
+	svc = calloc(np + 1, sizeof(*svc));
+	ev = calloc(nev + 1, sizeof(*ev));
+	str = malloc(slen);
+	if (!part || !pos || !svc || !ev || !str)
+		goto out;
+
+	/* the texts of each cache follow each other, names go at the end */
+	str[0] = 0;
+	slen = 1;
+	np = 0;
+	for (i = 0; i < nsips; i++) {
+		lists[0] = &sips[i].tps_done;
+		lists[1] = &sips[i].tps;
+		for (j = 0; j < 2; j++)
+			list_for_each_entry(tpi, lists[j], link)
+				list_for_each_entry(s, &tpi->services, link) {
+					if (!s->dbc)
+						continue;
+					memcpy(str + slen, s->dbc->str + 1, s->dbc->slen - 1);
+					for (k = 0; k < s->dbc->nrun; k++) {
+						p = &part[np++];
+						p->run = &s->dbc->run[k];
+						p->c = s->dbc;
+						p->s = s;
+						p->base = slen - 1;
+					}
+					slen += s->dbc->slen - 1;
+					nstr += s->dbc->nstr;
+				}
+	}
+	qsort(part, np, sizeof(*part), epgdb_part_cmp);
+
+	nev = 0;
+	for (p = part; p < part + np; p = q) {
+		for (q = p + 1; q < part + np && q->run->key == p->run->key; q++)
+			;
+		sv = &svc[nsvc++];
+		sv->onid = p->run->key >> 32;
+		sv->tsid = p->run->key >> 16;
+		sv->sid = p->run->key;
+		sv->first = nev;
+		/* the name from the SDT if one of the stores has it */
+		for (k = 0, s = NULL; k < q - p; k++)
+			if (p[k].s->name[0] && (!s || (p[k].s->got_sdt && !s->got_sdt)))
+				s = p[k].s;
+		if (s) {
+			sv->name = slen;
+			strcpy(str + slen, s->name);
+			slen += strlen(s->name) + 1;
+			nstr++;
+		}
+		sv->count = epgdb_merge(ev + nev, p, q - p, pos);
+		nev += sv->count;
+	}
+
+	memcpy(h.magic, EPGDB_MAGIC, sizeof(h.magic));
+	h.version = EPGDB_VERSION;
+	h.generation = gen;
+	h.written = time(NULL);
+	h.nservices = nsvc;
+	h.nevents = nev;
+	h.services = sizeof(h);
+	h.events = h.services + nsvc * sizeof(*svc);
+	h.strings = h.events + nev * sizeof(*ev);
+	h.strings_len = slen;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", epgdb_path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(tmp);
+		goto out;
+	}
+	if (write_full(fd, &h, sizeof(h)) < 0 ||
+	    write_full(fd, svc, nsvc * sizeof(*svc)) < 0 ||
+	    write_full(fd, ev, nev * sizeof(*ev)) < 0 ||
+	    write_full(fd, str, slen) < 0 || fsync(fd) < 0) {
+		perror(tmp);
+		unlink(tmp);
+		goto out;
+	}
+	if (rename(tmp, epgdb_path) < 0) {
+		perror(epgdb_path);
+		unlink(tmp);
+		goto out;
+	}
+	if (fsync_dir(epgdb_path) < 0) {
+		perror(epgdb_path);
+		goto out;
+	}
+	res = 0;
+	fprintf(stderr, "EPG database %s: generation %u, %u services (%d rebuilt), %u events, "
+		"%u strings (%u bytes) in %lld ms\n", epgdb_path, gen, nsvc, rebuilt, nev,
+		nstr, slen, (long long) (mtime_ms() - t0));
+out:
+	if (fd >= 0)
+		close(fd);
+	free(part);
+	free(pos);
+	free(svc);
+	free(ev);
+	free(str);
+	return res;
+}
+
+static uint32_t epgdb_next_gen(void)
+{
+	struct epgdb db;
+
+	if (!epgdb_gen && !epgdb_open(&db, epgdb_path)) {
+		epgdb_gen = db.hdr->generation;
+		epgdb_close(&db);
+	}
+	return ++epgdb_gen;
+}
+
+/* collect a writing child, block until it is done or only look */
+static void epgdb_reap(int block)
+{
+	pid_t pid;
+	int st;
+
+	if (!epgdb_child)
+		return;
+	while ((pid = waitpid(epgdb_child, &st, block ? 0 : WNOHANG)) < 0 && errno == EINTR)
+		;
+	if (!pid)
+		return;
+	if (pid == epgdb_child && WIFEXITED(st) && !WEXITSTATUS(st))
+		epgdb_written = epgdb_child_changes;
+	else
+		fprintf(stderr, "EPG database %s: write failed\n", epgdb_path);
+	epgdb_child = 0;
+}
+
+/* write the database now, at the end of a scan */
+static int epgdb_write(struct scanip *sips, int nsips)
+{
+	int n;
+
+	epgdb_reap(1);
+	n = epgdb_update(sips, nsips);
+	if (n < 0 || epgdb_save(sips, nsips, epgdb_next_gen(), n) < 0)
+		return -1;
+	epgdb_written = eit_changes;
+	return 0;
+}
+
+/*
+ * --daemon: write the next generation from a child at low priority.
+ * It has a copy of the stores as they are now, the sessions go on.
+ * One write at a time, a due one waits for the next EPGDB_MS.
+ */
+static void epgdb_write_bg(struct scanip *sips, int nsips)
+{
+	uint32_t gen;
+	pid_t pid;
+	int n;
+
+	epgdb_reap(0);
+	if (epgdb_child)
+		return;
+	n = epgdb_update(sips, nsips);
+	if (n < 0)
+		return;
+	gen = epgdb_next_gen();
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return;
+	}
+	if (!pid) {
+		setpriority(PRIO_PROCESS, 0, 10);
+		_exit(epgdb_save(sips, nsips, gen, n) < 0);
+	}
+	epgdb_child = pid;
+	epgdb_child_changes = eit_changes;
+}
+
+static void print_services(struct scantp *stp)
+{
+    struct tp_info *tpi = stp->tpi;
+    struct satipcon *scon = &stp->scon;
+    struct service *s;
+    int i;
+    
+    if (szfilename[0])
+        fp = fopen(szfilename, "a");
+    
+    list_for_each_entry(s, &tpi->services, link) {
+        char szPIDs[512];
+        char szTemp[1024];
+        size_t pids_len = 0; // Długość aktualnie zapisanych danych w szPIDs
+
+        memset(szPIDs, 0, sizeof(szPIDs));
+        memset(szTemp, 0, sizeof(szTemp));
+        
+        if (s->got_pmt && (s->vpid != 0 || s->anum > 0)) {
+            printf("SERVICE\n");
+            printf(" PNAME:%s\n", s->pname);
+            printf(" SNAME:%s\n", s->name);
+            printf(" ONID:%d\n", s->onid);
+            printf(" TSID:%d\n", s->tsid);
+            printf(" SID:%d\n", s->sid);
+            printf(" PIDS:%d", s->pmt);
+
+            snprintf(szTemp, sizeof(szTemp), "0,%d", s->pmt);
+            pids_len = strlen(szPIDs);
+            strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
+
+            uint16_t pcr = s->pcr;
+            if (s->pmt == pcr) pcr = 0;
+            if (s->vpid != 0) {
+                printf(",%d", s->vpid);
+                snprintf(szTemp, sizeof(szTemp), ",%d", s->vpid);
+                pids_len = strlen(szPIDs);
+                strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
+                if (s->vpid == pcr) pcr = 0;
+            }
+            for (i = 0; i < s->anum; i += 1) {
+                if (s->apid[i] != 0) {
+                    printf(",%d", s->apid[i]);
+                    snprintf(szTemp, sizeof(szTemp), ",%d", s->apid[i]);
+                    pids_len = strlen(szPIDs);
+                    strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
+                    if (s->apid[i] == pcr) pcr = 0;
+                }
+            }
+            if (s->sub != 0) {
+                printf(",%d", s->sub);
+                snprintf(szTemp, sizeof(szTemp), ",%d", s->sub);
+                pids_len = strlen(szPIDs);
+                strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
+                if (s->sub == pcr) pcr = 0;
+            }
+            if (s->ttx != 0) {
+                printf(",%d", s->ttx);
+                snprintf(szTemp, sizeof(szTemp), ",%d", s->ttx);
+                pids_len = strlen(szPIDs);
+                strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
+                if (s->ttx == pcr) pcr = 0;
+            }
+            if (pcr != 0) {
+                printf(",%d", pcr);
+                snprintf(szTemp, sizeof(szTemp), ",%d", pcr);
+                pids_len = strlen(szPIDs);
+                strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
+            }
+            printf("\n");
+            if (s->anum > 0 && s->apid[0] != 0) {
+                printf(" APIDS:%d", s->apid[0]);
+                for (i = 1; i < s->anum; i += 1) {
+                    if (s->apid[i] != 0) {
+                        printf(",%d", s->apid[i]);
+                    }
+                }
+            }
+            printf("\n");
+            if (s->vpid == 0)
+                printf(" RADIO:1\n");
+            if (s->ca_mode)
+                printf(" ENC:1\n");
+            printf(" EIT:%d%d\n", s->eit_pf, s->eit_sched);
+            printf("END\n");
+            
+            switch (tpi->msys) 
+            {
+                case 1: // DVB-C
+                    snprintf(szTemp, sizeof(szTemp), "#EXTINF:-1,%s\nrtsp://%s:%s/?freq=%u&msys=dvbc&sr=%u&mtype=%s&pids=%s\n", 
+                             s->name, scon->host, scon->port, tpi->freq, tpi->sr, mtype2str[tpi->mod], szPIDs);
+                    break;
+                case 3: // DVB-T
+                    snprintf(szTemp, sizeof(szTemp), "#EXTINF:-1,%s\nrtsp://%s:%s/?freq=%u&msys=dvbt&bw=%s&tmode=%s&gi=%s&pids=%s\n", 
+                             s->name, scon->host, scon->port, tpi->freq, bw2str[tpi->bw], tmode2str[tpi->tmode], gi2str[tpi->gi], szPIDs);
+                    break;
+                case 5: // DVB-S
+                case 6: // DVB-S2
+                    snprintf(szTemp, sizeof(szTemp), "#EXTINF:-1,%s\nrtsp://%s:%s/?src=%u&freq=%u&pol=%s&ro=%s&msys=%s&mtype=%s&plts=%s&sr=%u&fec=%s&pids=%s\n", 
+                             s->name, scon->host, scon->port, tpi->src, tpi->freq, pol2str[tpi->pol], roll2str[tpi->ro], msys2str[tpi->msys], mtype2str[tpi->mod], pilot2str[0], tpi->sr, fec2str[tpi->fec], szPIDs);
+                    break;
+                case 16: // DVB-T2
+                    snprintf(szTemp, sizeof(szTemp), "#EXTINF:-1,%s\nrtsp://%s:%s/?freq=%u&msys=dvbt2&bw=%s&tmode=%s&gi=%s&pids=%s\n", 
+                             s->name, scon->host, scon->port, tpi->freq, bw2str[tpi->bw], tmode2str[tpi->tmode], gi2str[tpi->gi], szPIDs);
+                    break;
+                case 19: // DVB-C2
+                    snprintf(szTemp, sizeof(szTemp), "#EXTINF:-1,%s\nrtsp://%s:%s/?freq=%u&msys=dvbc2&sr=%u&mtype=%s&pids=%s\n", 
+                             s->name, scon->host, scon->port, tpi->freq, tpi->sr, mtype2str[tpi->mod], szPIDs);
+                    break;
             }
+            printf("%s", szTemp);
+            if (szfilename[0])
+                fprintf(fp, "%s", szTemp);
+            fflush(stdout);
         }
     }
-    return 0;
+    if (szfilename[0])
+        fclose(fp);
 }
 
-static int pat_cb(struct sfilter *sf)
+/****************************************************************************/
+/* RTSP session state machine, driven by scanip() */
+
+
+static void rtsp_flush(struct satipcon *scon)
 {
-    struct pid_info *p = sf->pidi;
-    uint8_t *buf = p->buf;
-    int slen, c;
-    uint16_t pid, pnr;
+	struct scantp *stp = container_of(scon, struct scantp, scon);
+	uint32_t mask;
+	int n;
+
+	while (scon->wlen) {
+		n = send(scon->sock, scon->wbuf, scon->wlen, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				scon->error = 1;
+			break;
+		}
+		memmove(scon->wbuf, scon->wbuf + n, scon->wlen - n);
+		scon->wlen -= n;
+	}
+	mask = stp->urtsp ? 0 : EPOLLIN;
+	if (scon->wlen)
+		mask |= EPOLLOUT;
+	if (mask != scon->evmask && !ev_ctl(EPOLL_CTL_MOD, scon->sock, &stp->rtsp_ev, mask))
+		scon->evmask = mask;
+}
 
-    slen = (((buf[1] & 0x03) << 8) | buf[2]) + 3;
-    sf->ext = ((buf[3] << 8) | buf[4]);
-    p->tsi->tsid = sf->ext;
+static void rtsp_queue(struct satipcon *scon, const void *buf, int len)
+{
+	if (scon->wlen + len > sizeof(scon->wbuf)) {
+		fprintf(stderr, "RTSP send buffer full for %s\n", scon->tune);
+		scon->error = 1;
+		return;
+	}
+	memcpy(scon->wbuf + scon->wlen, buf, len);
+	scon->wlen += len;
+	scon->pending++;
+	if (scon->state != RTSP_CONNECT)
+		rtsp_flush(scon);
+}
 
-    fprintf(stderr, "PAT: TSID %04x, section length %d\n", p->tsi->tsid, slen);
-    for (c = 8; c < slen - 4; c += 4) {
-        pnr = (buf[c] << 8) | buf[c + 1];
-        pid = get_pid(buf + c + 2);
-        fprintf(stderr, " PNR %04x PID %04x\n", pnr, pid);
-        if (pnr) {
-            add_sfilter(p->tsi, pid, 0x02, pnr, 2, 60); // PMT, timeout 60s
-            add_sfilter(p->tsi, 0x11, 0x42, pnr, 2, 60); // SDT dla konkretnego SID, timeout 60s
-        } else {
-            add_sfilter(p->tsi, pid, 0x40, 0, 1, 120); // NIT, timeout 120s
-        }
-    }
-    return 0;
+/*
+ * PLAY with the tuning parameters and the PIDs of the table filters,
+ * after SETUP or to retune an existing session.
+ */
+static void stp_tune(struct scantp *stp)
+{
+	struct satipcon *scon = &stp->scon;
+
+	scon->state = RTSP_PLAY;
+	scon->deadline = mtime_ms() + RTSP_TIMEOUT;
+	/* so the first PLAY already asks for their PIDs */
+	if (!stp->tsi.pids_sent) {
+		add_sfilter(&stp->tsi, 0x00, 0x00, 0, 0, 60); // PAT, timeout 60s
+		add_sfilter(&stp->tsi, 0x11, 0x42, 0, 1, 60); // SDT, timeout 60s
+		if (stp->tpi->use_nit) {
+			add_sfilter(&stp->tsi, 0x10, 0x40, 0, 1, 120); // NIT, timeout 120s
+		}
+	}
+	update_pids(&stp->tsi);
 }
 
-#define UTF8_CC_START 0xc2
-#define SB_CC_RESERVED_80 0x80
-#define SB_CC_RESERVED_81 0x81
-#define SB_CC_RESERVED_82 0x82
-#define SB_CC_RESERVED_83 0x83
-#define SB_CC_RESERVED_84 0x84
-#define SB_CC_RESERVED_85 0x85
-#define CHARACTER_EMPHASIS_ON 0x86
-#define CHARACTER_EMPHASIS_OFF 0x87
-#define SB_CC_RESERVED_88 0x88
-#define SB_CC_RESERVED_89 0x89
-#define CHARACTER_CR_LF 0x8a
-#define SB_CC_USER_8B 0x8b
-#define SB_CC_USER_9F 0x9f
+static void rtsp_reply(struct scantp *stp, int res)
+{
+	struct satipcon *scon = &stp->scon;
 
-void en300468_parse_string_to_utf8(char *dest, uint8_t *src,
-		const unsigned int len)
+	if (scon->pending)
+		scon->pending--;
+	if (scon->stale) {
+		scon->stale--;
+		return;
+	}
+	switch (scon->state) {
+	case RTSP_SETUP:
+		if (res < 0) {
+			fprintf(stderr, "SETUP failed for %s (no free tuner?)\n", scon->tune);
+			scon->error = 1;
+			break;
+		}
+		stp_tune(stp);
+		break;
+	case RTSP_PLAY:
+		if (res < 0) {
+			fprintf(stderr, "PLAY failed for %s\n", scon->tune);
+			scon->error = 1;
+			break;
+		}
+		scon->state = RTSP_RUNNING;
+		scon->deadline = 0;
+		stp->last_data = mtime_ms();
+		stp->timeout = stp->last_data + 300000; // Początkowy timeout 5 minut
+		break;
+	case RTSP_RUNNING:
+		if (res < 0 && !stp->tsi.pids_full) {
+			fprintf(stderr, "addpids/delpids refused, sending full PID lists\n");
+			stp->tsi.pids_full = 1;
+			pids_schedule(&stp->tsi);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void rtsp_lost(struct satipcon *scon)
 {
-	int utf8 = (src[0] == 0x15) ? 1 : 0;
-	int skip = (src[0] < 0x20) ? 1 : 0;
-	if( src[0] == 0x10 ) skip += 2;
-	uint16_t utf8_cc;
-	int dest_pos = 0;
-	int emphasis = 0;
-	int i;
+	if (scon->state != RTSP_TEARDOWN)
+		fprintf(stderr, "RTSP connection to %s lost\n", scon->host);
+	scon->error = 1;
+}
 
-	for (i = skip; i < len; i++) {
-		switch(*(src + i)) {
-			case SB_CC_RESERVED_80 ... SB_CC_RESERVED_85:
-			case SB_CC_RESERVED_88 ... SB_CC_RESERVED_89:
-			case SB_CC_USER_8B ... SB_CC_USER_9F:
-			case CHARACTER_CR_LF:
-				dest[dest_pos++] = '\n';
-				continue;
-			case CHARACTER_EMPHASIS_ON:
-				emphasis = 1;
-				continue;
-			case CHARACTER_EMPHASIS_OFF:
-				emphasis = 0;
-				continue;
-			case UTF8_CC_START:
-				if (utf8 == 1) {
-					utf8_cc = *(src + i) << 8;
-					utf8_cc += *(src + i + 1);
+static void rtp_data(struct scantp *stp, int64_t now);
+static void rtp_input(struct scantp *stp, uint8_t *buf, int len);
+static void rtcp_input(struct scantp *stp, uint8_t *buf, int len);
 
-					switch(utf8_cc) {
-						case ((UTF8_CC_START << 8) | CHARACTER_EMPHASIS_ON):
-							emphasis = 1;
-							i++;
-							continue;
-						case ((UTF8_CC_START << 8) | CHARACTER_EMPHASIS_OFF):
-							emphasis = 0;
-							i++;
-							continue;
-						default:
-							break;
-					}
-				}
-			default: {
-				if (*(src + i) < 128)
-					dest[dest_pos++] = *(src + i);
-				else {
-					dest[dest_pos++] = 0xc2 + (*(src + i) > 0xbf);
-					dest[dest_pos++] = (*(src + i) & 0x3f) | 0x80;
-				}
+/* $-framed data of an interleaved session, channel 0 is RTP, 1 RTCP */
+static void rtsp_frame(struct scantp *stp, int ch, uint8_t *buf, int len)
+{
+	if (ch == 1)
+		rtcp_input(stp, buf, len);
+	if (ch || stp->scon.state != RTSP_RUNNING)
+		return;
+	stp->rx_datagrams++;
+	rtp_data(stp, mtime_ms());
+	rtp_input(stp, buf, len);
+}
+
+/* handle all complete replies and interleaved frames in rbuf */
+static void rtsp_parse(struct scantp *stp)
+{
+	struct satipcon *scon = &stp->scon;
+	char *b, *e;
+	int off = 0, n, hl;
+
+	scon->rbuf[scon->rlen] = 0;
+	while (!scon->error && off < scon->rlen) {
+		b = scon->rbuf + off;
+		if (scon->http && scon->state == RTSP_RUNNING) {
+			/* the body is plain TS, whole packets go to the demuxer */
+			n = (scon->rlen - off) / 188 * 188;
+			if (!n)
+				break;
+			rtp_data(stp, mtime_ms());
+			proc_tsps(&stp->tsi, (uint8_t *) b, n);
+		} else if (*b == '$') {
+			if (scon->rlen - off < 4)
+				break;
+			n = 4 + (((uint8_t) b[2] << 8) | (uint8_t) b[3]);
+			if (n > scon->rlen - off)
 				break;
+			rtsp_frame(stp, b[1], (uint8_t *) b + 4, n - 4);
+		} else {
+			e = strstr(b, "\r\n\r\n");
+			if (!e)
+				break;
+			hl = e + 4 - b;
+			if (scon->http) {
+				/* no body length, the stream follows */
+				n = hl;
+				rtsp_reply(stp, strncasecmp(b, "HTTP/1.", 7) ||
+					   strncmp(b + 8, " 200", 4) ? -1 : 0);
+				off += n;
+				continue;
 			}
+			n = hl + rtsp_content_length(b, e);
+			if (n > scon->rlen - off)
+				break;
+			rtsp_reply(stp, check_ok(b, hl, scon->sid, &scon->strid));
 		}
+		off += n;
+	}
+	if (off) {
+		memmove(scon->rbuf, scon->rbuf + off, scon->rlen - off);
+		scon->rlen -= off;
+		scon->rbuf[scon->rlen] = 0;
+	}
+	if (scon->rlen == sizeof(scon->rbuf) - 1) {
+		fprintf(stderr, "RTSP reply too long\n");
+		scon->error = 1;
 	}
-	dest[dest_pos] = '\0';
 }
 
-static void sscopy(char *b, char *a, int len)
+static void rtsp_read(struct scantp *stp)
 {
-	while (len--) {
-		if (*a > 0x20 && (*a < 0x80 || *a > 0x9f))
-			*b++ = *a;
-		a++;
+	struct satipcon *scon = &stp->scon;
+	int n;
+
+	n = recv(scon->sock, scon->rbuf + scon->rlen,
+		 sizeof(scon->rbuf) - 1 - scon->rlen, 0);
+	if (n <= 0) {
+		if (!n || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			rtsp_lost(scon);
+		return;
 	}
-	*b = 0;
+	scon->rlen += n;
+	rtsp_parse(stp);
 }
 
-
-static int sdt_cb(struct sfilter *sf)
+/* RTSP data received through io_uring */
+static void rtsp_input(struct scantp *stp, uint8_t *buf, int len)
 {
-	struct pid_info *p = sf->pidi;
-	uint8_t *buf=p->buf, tag;
-	int c, dll, dl, d, doff;
-	uint16_t onid, sid, tsid;
-	struct service *s;
-
-	tsid = get16(buf + 3);
-	onid = get16(buf + 8);
-	for (c = 11; c < p->len - 4; c += dll + 5) {
-		int spnl, snl;
+	struct satipcon *scon = &stp->scon;
 
-		sid = get16(buf + c);
-		dll = get12(buf + c + 3);
+	if (len > sizeof(scon->rbuf) - 1 - scon->rlen) {
+		fprintf(stderr, "RTSP reply too long\n");
+		scon->error = 1;
+		return;
+	}
+	memcpy(scon->rbuf + scon->rlen, buf, len);
+	scon->rlen += len;
+	rtsp_parse(stp);
+}
 
-		s = get_service(p->tsi->stp->tpi, sid);
-		s->onid = onid;
-		s->tsid = tsid;
-		s->eit_sched = ( buf[c + 2] & 0x02 ) >> 1;
-		s->eit_pf    = ( buf[c + 2] & 0x01 );
-		s->ca_mode   = ( buf[c + 3] & 0x10 ) >> 4;
+/* RTP data arrived for the session, called before it is demuxed */
+static void rtp_data(struct scantp *stp, int64_t now)
+{
+	struct scanip *sip = stp->sip;
+	struct sfilter *sf;
 
-		if ( p->tsi->stp->tpi->scan_eit && s->eit_sched /*&& !s->ca_mode*/ ) {
-			int i;
-			for ( i = 0; i < MAX_EIT_SID; i++ ) {
-				if (p->tsi->stp->tpi->eit_sid[0] == 0 || p->tsi->stp->tpi->eit_sid[i] == sid) {
-					eit_services += 1;
-					add_sfilter(p->tsi, 0x12, 0x50, sid, 2, 15);
-					break;
-				}
-			}
-		}
+	if (!stp->tuned) {
+		stp->tuned = 1;
+		sip->tunes++;
+		sip->tune_ms += now - stp->tune_start;
+		fprintf(stderr, "Tuned %s in %lld ms\n", stp->scon.tune,
+			(long long) (now - stp->tune_start));
+		/* filters added before the tuner locked wait from now on */
+		list_for_each_entry(sf, &stp->tsi.sfilters, tslink)
+			sfilter_arm(sf, now);
+	}
+	stp->tsi.now = now;
+	stp->last_data = now;
+	stp->timeout = now + 60000; // Przedłuż timeout o 60s po każdym pakiecie
+}
 
-		//fprintf(stderr, "sid = %04x, dll = %u\n", sid, dll);
-		for (d = 0; d < dll; d += dl + 2) {
-			doff = c + d + 5;
-			tag = buf[doff];
-			dl = buf[doff + 1];
-			//fprintf(stderr, "desc %02x: %u\n", tag, dl);
-			if (tag == 0x48) {
-				spnl = buf[doff + 3];
-				snl = buf[doff + 4 + spnl];
-            s->pname[79] = 0x00;
-            s->name[79] = 0x00;
-				en300468_parse_string_to_utf8(s->pname, buf + doff + 4, spnl);
-            if( s->pname[79] != 0 )
-               fprintf(stderr, "********************************************* PNAME OVERFLOW spnl = %d",(int) spnl);
-				en300468_parse_string_to_utf8(s->name, buf + doff + 5 + spnl, snl);
-            if( s->name[79] != 0 )
-               fprintf(stderr, "********************************************* SNAME OVERFLOW snl = %d",(int) snl);
-				s->got_sdt = 1;
-			}
-		}
+/* TS payload of an RTP datagram, NULL if the header is not RTP version 2 */
+static uint8_t *rtp_payload(uint8_t *buf, int *len)
+{
+	int n = *len, hl = 12 + (buf[0] & 0x0f) * 4;
+
+	if (n < 12 || (buf[0] & 0xc0) != 0x80)
+		return NULL;
+	if (buf[0] & 0x10) {
+		if (n < hl + 4)
+			return NULL;
+		hl += 4 + ((buf[hl + 2] << 8) | buf[hl + 3]) * 4;
 	}
+	if ((buf[0] & 0x20) && n > hl)
+		n -= buf[n - 1];
+	if (n <= hl)
+		return NULL;
+	*len = n - hl;
+	return buf + hl;
+}
 
-	return 0;
+/* hand over held datagrams from the expected one up to the next gap */
+static void rtp_drain(struct scantp *stp)
+{
+	struct rtp_seq *rs = &stp->rseq;
+	int i;
+
+	while (rs->held && rs->wlen[i = rs->next % RTP_REORDER]) {
+		proc_tsps(&stp->tsi, rs->win + i * RTP_SLOT, rs->wlen[i]);
+		rs->wlen[i] = 0;
+		rs->held--;
+		rs->next++;
+	}
+	if (rs->held)
+		rs->held_since = stp->tsi.now;
 }
 
-static int eit_cb(struct sfilter *sf,int refresh)
+/* give up the oldest gap */
+static void rtp_skip_gap(struct scantp *stp)
 {
-	struct pid_info *p = sf->pidi;
-	uint8_t *buf=p->buf, tag;
-	uint16_t tid, onid, sid, tsid;
-	uint8_t snr;
-	int slen, dll, c, dl, d, doff, l;
-	uint16_t eid,mjd,teid;
-	struct service *s;
-	struct event e;
-	struct event *pe;
+	struct rtp_seq *rs = &stp->rseq;
 
-	tid  = buf[0];
-	sid  = get16(buf + 3);
-	tsid = get16(buf + 8);
-	onid = get16(buf + 10);
-	snr  = buf[6];
+	do {
+		rs->lost++;
+		rs->next++;
+	} while (!rs->wlen[rs->next % RTP_REORDER]);
+	rtp_drain(stp);
+}
 
-	slen = get12(buf + 1) + 3;
-	if (buf[1] & 0x80)
-		slen -= 4;
+/* for the next transponder, keeps the window buffer */
+static void rtp_seq_reset(struct rtp_seq *rs)
+{
+	uint8_t *win = rs->win;
 
-	s = get_service(p->tsi->stp->tpi, sid);
+	memset(rs, 0, sizeof(*rs));
+	rs->win = win;
+}
 
-	if ( refresh ) {
-		fprintf(stderr,"eit_cb refresh %02X %u\n",tid,sid);
-		struct event *npe;
-		list_for_each_entry_safe(pe, npe, &s->events, link) {
-			if( pe->tid == tid ) {
-				list_del(&pe->link);
-				free_event(pe);
-				eit_events_deleted += 1;
-			}
+static void rtp_input(struct scantp *stp, uint8_t *buf, int len)
+{
+	struct rtp_seq *rs = &stp->rseq;
+	uint16_t seq;
+	uint8_t *ts;
+	int d, filled, i;
+
+	ts = rtp_payload(buf, &len);
+	if (!ts) {
+		rs->bad++;
+		return;
+	}
+	seq = (buf[2] << 8) | buf[3];
+	d = (int16_t) (seq - rs->next);
+	if (!rs->synced || d <= -RTP_RESYNC || d >= RTP_RESYNC) {
+		/* first datagram, or the server restarted the stream */
+		while (rs->held)
+			rtp_skip_gap(stp);
+		rs->synced = 1;
+		rs->next = seq;
+		d = 0;
+	}
+	if (d < 0) {
+		rs->late++;
+		return;
+	}
+	filled = !d && rs->held;
+	while (d >= RTP_REORDER) {
+		if (rs->held)
+			rtp_skip_gap(stp);
+		else {
+			rs->lost += d - RTP_REORDER + 1;
+			rs->next += d - RTP_REORDER + 1;
 		}
+		d = (int16_t) (seq - rs->next);
 	}
+	if (d) {
+		i = seq % RTP_REORDER;
+		if (rs->wlen[i]) {
+			rs->late++;
+			return;
+		}
+		if (!rs->win && !(rs->win = malloc(RTP_REORDER * RTP_SLOT))) {
+			proc_tsps(&stp->tsi, ts, len);
+			return;
+		}
+		memcpy(rs->win + i * RTP_SLOT, ts, len);
+		rs->wlen[i] = len;
+		if (!rs->held++)
+			rs->held_since = stp->tsi.now;
+		return;
+	}
+	rs->reordered += filled;
+	proc_tsps(&stp->tsi, ts, len);
+	rs->next++;
+	rtp_drain(stp);
+}
 
-	eit_size += slen;
-	eit_sections += 1;
-
-//	fprintf(stderr, "EIT %02x %d:%d:%d %d %d\n",tid,onid,tsid,sid,snr,slen);
+/*
+ * RTCP compound packet of the server. The SAT>IP APP packet (name
+ * "SES1") carries "ver=1.0;src=..;tuner=<fe>,<level>,<lock>,<quality>,..."
+ */
+static void rtcp_input(struct scantp *stp, uint8_t *buf, int len)
+{
+	int n, slen, fe, level, lock, quality;
+	char str[256], *t;
 
+	for (; len >= 4; buf += n, len -= n) {
+		n = (((buf[2] << 8) | buf[3]) + 1) * 4;
+		if ((buf[0] & 0xc0) != 0x80 || n > len)
+			return;
+		if (buf[1] != 204 || n < 16 || memcmp(buf + 8, "SES1", 4))
+			continue;
+		slen = (buf[14] << 8) | buf[15];
+		if (slen > n - 16)
+			slen = n - 16;
+		if (slen > sizeof(str) - 1)
+			slen = sizeof(str) - 1;
+		memcpy(str, buf + 16, slen);
+		str[slen] = 0;
+		t = strstr(str, "tuner=");
+		if (!t || sscanf(t + 6, "%d,%d,%d,%d", &fe, &level, &lock, &quality) != 4)
+			continue;
+		stp->sig_reports++;
+		stp->sig_level = level;
+		stp->sig_lock |= lock;
+		stp->sig_quality = quality;
+	}
+}
 
-	for (c = 14; c < slen; c += dll + 12) {
-		memset(&e, 0, sizeof(struct event));
+/****************************************************************************/
+/*
+ * io_uring receive backend (--rx=uring)
+ *
+ * Every session socket gets one multishot IORING_OP_RECV that picks its
+ * buffers from a provided buffer ring, so datagrams arrive as CQEs
+ * without a recv syscall each. The ring fd itself is watched by epoll.
+ */
+
+#define URING_ENTRIES 256
+#define URING_BUFS    512	/* power of 2 */
+#define URING_BGID    0
+
+struct uring {
+	int fd;
+	unsigned sq_mask, sq_entries, cq_mask;
+	unsigned *sq_head, *sq_tail, *sq_array;
+	unsigned *cq_head, *cq_tail;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring;
+	size_t ring_len;
+	unsigned to_submit;
+
+	struct io_uring_buf_ring *br;
+	uint16_t br_tail;
+	uint8_t *bufs;
+	unsigned cancels;	/* stopped receives still waiting for their final CQE */
+
+	struct evsrc ev;
+};
 
-		e.tid = tid;
-		e.sid = sid;
-		e.tsid = tsid;
-		e.onid = onid;
-		e.eid = get16(buf + c + 0);
+/* one armed multishot receive, freed after its final CQE */
+struct uring_recv {
+	struct scantp *stp;	/* NULL once the session is gone */
+	int fd;
+	int rtp;
+};
 
-		e.mjd = get16(buf + c + 2);
-		e.sh = getbcd(buf + c + 4,2);
-		e.sm = getbcd(buf + c + 5,2);
-		e.ss = getbcd(buf + c + 6,2);
-		e.dh = getbcd(buf + c + 7,2);
-		e.dm = getbcd(buf + c + 8,2);
-		e.ds = getbcd(buf + c + 9,2);
+static struct uring *uring;
 
-//		fprintf(stderr, "                Event %5d  %5d Start %02d:%02d:%02d Duration %02d:%02d:%02d\n",e.eid,e.mjd,e.sh,e.sm,e.ss,e.dh,e.dm,e.ds);
-		dll = get12(buf + c + 10);
+static int uring_submit(struct uring *u)
+{
+	int n;
 
-		eit_events += 1;
-		//eit_shortsize += sizeof(struct event) + 16;
+	if (!u->to_submit)
+		return 0;
+	n = syscall(__NR_io_uring_enter, u->fd, u->to_submit, 0, 0, NULL, 0);
+	if (n < 0)
+		return -1;
+	u->to_submit -= n;
+	return 0;
+}
 
-		for (d = 0; d < dll; d += dl + 2) {
-			doff = c + d + 12;
-			tag = buf[doff];
-			dl = buf[doff + 1];
-			switch ( tag ) {
-				case 0x42: // Stuffing
-					break;
-				case 0x4A: // linkage
-				   if ( buf[doff+8] == 0x0D ) {
-						teid = get16(buf + doff + 9);
-						fprintf(stderr, "   LINK SID %5u EID %5u Tag %5u listet = %d, simul = %d\n"
-									        ,sid,e.eid,teid,(buf[doff + 11] & 0x80) >> 7, (buf[doff + 11] & 0x80) >> 6 );
-					} else
-						fprintf(stderr, "   LINK SID %5u EID %5u Type 0x%02X len %d\n",sid,e.eid,buf[doff+8],slen);
-					break;
-				case 0x4D: // short
-					if( dl >= 5 ) {
-						e.s_lang[0] = buf[doff + 2];
-						e.s_lang[1] = buf[doff + 3];
-						e.s_lang[2] = buf[doff + 4];
-						doff += 5;
-						l = buf[doff];
-						if (l > 0) {
-							e.s_name = malloc(l+1);
-							if( e.s_name ) {
-								memcpy(e.s_name,buf + doff, l + 1);
-							}
-						}
-						eit_shortsize +=  l;
-						doff += l + 1;
-						l = buf[doff];
-						if (l > 0) {
-							e.s_text = malloc(l+1);
-							if( e.s_text ) {
-								memcpy(e.s_text,buf + doff, l + 1);
-							}
-						}
-						eit_shortsize += l;
-					}
-					break;
-				case 0x4E: // extended
-					break;
-				case 0x4F: // time shift
-					break;
-				case 0x50: // component
-					break;
-				case 0x53: // CA
-					break;
-				case 0x54: // content
-					break;
-				case 0x55: // parental
-					break;
-				case 0x57: // telephone
-					break;
-				case 0x5E: // multilingual
-					break;
-				case 0x5F: // private data
-					break;
-				case 0x61: // short smoothing buffer
-					break;
-				case 0x64: // data broadcast
-					break;
-				case 0x69: // private data
-					break;
-				case 0x75: // TVA id
-					break;
-				case 0x76: // content identifier
-					break;
-				case 0x7D: // XAIT location
-					break;
-				case 0x7E: // FTA content managment
-					break;
-				case 0x7F: // extension
-					break;
-				default:
-					//fprintf(stderr, "   SID %5u EID %5u Tag %02x  len %d\n",sid,e.eid,tag,slen);
-					break;
-			}
-		}
+static struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *u->sq_tail;
 
-		pe = malloc(sizeof(struct event));
-		if (pe) {
-			memcpy(pe,&e,sizeof(struct event));
-			list_add_tail(&pe->link, &s->events);
-		} else {
-			if (e.s_name) free(e.s_name);
-			if (e.s_text) free(e.s_text);
-		}
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		if (uring_submit(u) < 0 ||
+		    tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+			return NULL;
 	}
-
-	return 0;
+	sqe = &u->sqes[tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	return sqe;
 }
 
-static int all_zero_8(uint32_t *p)
+static void uring_buf_put(struct uring *u, unsigned bid)
 {
-	return (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7]) ? 0 : 1;
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUFS - 1)];
+
+	b->addr = (uint64_t) (uintptr_t) (u->bufs + bid * RTP_SLOT);
+	b->len = RTP_SLOT;
+	b->bid = bid;
+	u->br_tail++;
 }
 
-static int proc_sec(struct pid_info *p)
+static void uring_buf_publish(struct uring *u)
 {
-	uint8_t *buf=p->buf;
-	uint8_t snr, vnr, lsnr, tid;
-	struct sfilter *sf, *sfn;
-	uint16_t ext;
-	int i, n, res;
-	int refresh;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
 
-	tid = buf[0];
-	ext = ((buf[3] << 8) | buf[4]);
-	vnr = (buf[5] & 0x3f) >> 1;
-	snr = buf[6];
-	lsnr = buf[7];
+static int uring_arm(struct uring_recv *ur)
+{
+	struct io_uring_sqe *sqe = uring_sqe(uring);
 
-	list_for_each_entry_safe(sf, sfn, &p->sfilters, link) {
-		if (tid != sf->tid)
-			continue;
-		if (p->add_ext) {
-			if (sf->use_ext == 2) {
-				if (ext != sf->ext)
-					continue;
-			} else {
-				sf->ext = ext;
-				sf->use_ext = 2;
-			}
-		}
-		refresh = 0;
-		if (!sf->vnr_set) {
-			sf->vnr = vnr;
-			sf->vnr_set = 1;
-		}
-		if (sf->vnr != vnr) {
-			fprintf(stderr, "TID %02x ext %u\n", tid, ext);
-			fprintf(stderr, "VNR change %u->%u\n", sf->vnr, vnr);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = ur->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = (uint64_t) (uintptr_t) ur;
+	return uring_submit(uring);
+}
 
-			sf->todo_set = 0;
-			sf->vnr = vnr;
-			refresh = 1;
-			//sf->done = 0;
-		}
-		if (sf->done)
-			break;
-		if (!sf->todo_set) {
-			for (i = 0; i <= lsnr; i++)
-				sf->todo[i >> 5] |= (1UL << (i & 31));
-			sf->todo_set = 1;
-
-			if (tid == 0x50 || tid == 0x60) {
-				uint8_t ltid = buf[13] & 0x0F;
-				for (i = 1; i <= ltid; i++) {
-					add_sfilter(p->tsi, 0x12, tid + i, sf->ext, 2, i < 2 ? 15 : 45);
-				}
-			}
-		}
-		if ( sf->todo[snr >> 5] & (1UL << (snr & 31)) ) {
-			switch (tid) {
-			case 0x00:
-				res = pat_cb(sf);
-				break;
-			case 0x02:
-				res = pmt_cb(sf);
-				break;
-			case 0x40:
-			case 0x41:
-				res = nit_cb(sf);
-				break;
-			case 0x42:
-			case 0x46:
-				res = sdt_cb(sf);
-				break;
-			default:
-				if (tid >= 0x4E && tid <= 0x6F)
-					res = eit_cb(sf, refresh);
-				else
-					res = -1;
-				break;
-			}
-			if (res == 0) {
-				sf->todo[snr >> 5] &= ~(1UL << (snr & 31));
-				if (tid >= 0x4E && tid <= 0x6F) {
-					uint8_t slsnr = buf[12];
-					for (i = slsnr + 1; i <= (slsnr | 7); i++)
-						sf->todo[i >> 5] &= ~(1UL << (i & 31));
-						//fprintf(stderr, "    %08x%08x%08x%08x%08x%08x%08x%08x\n",
-						//		sf->todo[7],sf->todo[6],sf->todo[5],sf->todo[4],sf->todo[3],sf->todo[2],sf->todo[1],sf->todo[0]);
-				}
-				if (all_zero_8(sf->todo)) {
-					sf->done = 1;
-					list_del(&sf->tslink);
-				} else
-					sf->timeout = mtime(NULL) + sf->timeout_len;
-				break;
-			}
-		}
+static struct uring_recv *uring_recv_start(struct scantp *stp, int fd, int rtp)
+{
+	struct uring_recv *ur = calloc(1, sizeof(struct uring_recv));
+
+	if (!ur)
+		return NULL;
+	ur->stp = stp;
+	ur->fd = fd;
+	ur->rtp = rtp;
+	if (uring_arm(ur) < 0) {
+		free(ur);
+		return NULL;
 	}
-	if (&sf->link == &p->sfilters)
-		return -1;
-	return 0;
+	return ur;
 }
 
+/* must be called before the socket is closed */
+static void uring_recv_stop(struct uring_recv *ur)
+{
+	struct io_uring_sqe *sqe;
 
+	if (!ur)
+		return;
+	ur->stp = NULL;
+	sqe = uring_sqe(uring);
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t) (uintptr_t) ur;
+	sqe->user_data = 0;
+	uring->cancels++;
+	uring_submit(uring);
+}
 
-static int pid_info_proc_section(struct pid_info *p)
+static void uring_input(struct uring_recv *ur, uint8_t *buf, int len, int64_t now)
 {
-	struct sfilter *sf, *sfn;
-	uint8_t *buf = p->buf;
-	uint8_t tid;
-	uint16_t ext;
-	int res;
+	struct scantp *stp = ur->stp;
 
-	if (p->bufp != p->len) {
-		if (p->len && p->bufp > p->len)
-			goto exit;
-		return 0;
+	if (!ur->rtp) {
+		rtsp_input(stp, buf, len);
+		return;
 	}
-	if (buf[1] & 0x80) {
-		if (dvb_crc32(buf, p->len)) {
-			fprintf(stderr, "CRC error pid %04x!\n", p->pid);
-			goto exit;
+	/* a retuned session may still get datagrams of the previous mux */
+	if (stp->scon.state != RTSP_RUNNING)
+		return;
+	stp->rx_datagrams++;
+	rtp_data(stp, now);
+	rtp_input(stp, buf, len);
+}
+
+static void uring_handler(struct evsrc *ev, uint32_t events)
+{
+	struct uring *u = container_of(ev, struct uring, ev);
+	struct io_uring_cqe *cqe;
+	struct uring_recv *ur;
+	unsigned head, tail, bid;
+	int64_t now = mtime_ms();
+
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &u->cqes[head & u->cq_mask];
+		ur = (struct uring_recv *) (uintptr_t) cqe->user_data;
+		if (!ur)
+			continue;
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (ur->stp && cqe->res > 0)
+				uring_input(ur, u->bufs + bid * RTP_SLOT, cqe->res, now);
+			uring_buf_put(u, bid);
+		}
+		if (cqe->flags & IORING_CQE_F_MORE)
+			continue;
+		/* multishot ended: cancelled, out of buffers, EOF or error */
+		if (!ur->stp) {
+			free(ur);
+			u->cancels--;
+		} else if (cqe->res == -ENOBUFS || (ur->rtp && cqe->res >= 0)) {
+			uring_buf_publish(u);
+			if (uring_arm(ur) < 0)
+				ur->stp->scon.error = 1;
+		} else if (!ur->rtp && cqe->res >= 0) {
+			rtsp_lost(&ur->stp->scon);
+		} else {
+			fprintf(stderr, "io_uring receive failed: %s\n", strerror(-cqe->res));
+			ur->stp->scon.error = 1;
 		}
 	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	uring_buf_publish(u);
+	uring_submit(u);
+}
 
-	//fprintf(stderr, "PID %04x SEC[%d]: %02x\n", (int) p->pid, p->len, (int)p->buf[0]);
-	if (p->len < 8)
-		return 0;
-	if (!(buf[5] & 1))
-		return 0;
-
-
-	tid = buf[0];
-	ext = ((buf[3] << 8) | buf[4]);
-
-	res = proc_sec(p);
+/* block until the next CQE is there, the caller marks it seen */
+static struct io_uring_cqe *uring_wait(struct uring *u)
+{
+	unsigned head = *u->cq_head;
 
-	if (res && p->add_ext) {
-		if (tid == 0x42 || tid == 0x02) {
-			fprintf(stderr, "section not matched");
-			fprintf(stderr, "adding %02x:%04x\n", tid, ext);
-			//add_sfilter(p->tsi, p->pid, tid, ext, 1, 5);
-			//proc_sec(p);
-		}
+	while (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS,
+			    NULL, 0) < 0 && errno != EINTR)
+			return NULL;
 	}
-exit:
-	pid_info_reset(p);
-	return 0;
+	return &u->cqes[head & u->cq_mask];
 }
 
-/****************************************************************************/
-/****************************************************************************/
+static void uring_seen(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
 
-static inline void write_secbuf(struct pid_info *p, uint8_t *tsp, int n)
+/* reap the final CQEs of the stopped receives, before the loop goes away */
+static void uring_drain(void)
 {
-	memcpy(p->buf+p->bufp, tsp, n);
-	p->bufp += n;
+	if (!uring)
+		return;
+	uring_submit(uring);
+	while (uring->cancels && uring_wait(uring))
+		uring_handler(&uring->ev, EPOLLIN);
 }
 
-static inline int validcc(struct pid_info *p, uint8_t *tsp)
+/*
+ * Multishot recv needs Linux 6.0, older kernels only fail the SQE once
+ * it runs. Arm one on a socketpair, send it a datagram and check that
+ * the completion announces more, then cancel it again.
+ */
+static int uring_probe(void)
 {
-	uint8_t newcc;
-	int valid;
+	struct io_uring_cqe *cqe;
+	struct uring_recv ur;
+	int sv[2], res = -1, stopped = 0;
 
-	newcc = tsp[3] & 0x0f;
-        valid = (((p->cc + 1) & 0x0f) == newcc) ? 1 : 0;
-	if (p->cc == 0xff)
-		valid=1;
-        p->cc = newcc;
-	if (!valid) {
-		fprintf(stderr, "CC error PID %04x!\n", p->pid);
-		pid_info_reset(p);
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sv) < 0)
+		return -1;
+	memset(&ur, 0, sizeof(ur));
+	ur.fd = sv[0];
+	if (uring_arm(&ur) < 0 || send(sv[1], "", 1, 0) != 1)
+		goto out;
+	while ((cqe = uring_wait(uring))) {
+		if (cqe->user_data != (uintptr_t) &ur) {
+			uring_seen(uring);
+			continue;
+		}
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+			uring_buf_put(uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			uring_seen(uring);
+			break;
+		}
+		if (!stopped) {
+			res = cqe->res > 0 ? 0 : -1;
+			uring_recv_stop(&ur);
+			stopped = 1;
+		}
+		uring_seen(uring);
 	}
-	return valid;
+	if (!cqe)
+		res = -1;
+	else if (stopped)
+		uring->cancels--;
+	uring_buf_publish(uring);
+out:
+	close(sv[0]);
+	close(sv[1]);
+	return res;
 }
 
-static inline int pid_info_build_section(struct pid_info *p, uint8_t *tsp)
+static int uring_init(void)
 {
-        int pusoff, todo = tspayload(tsp), i = 188 - todo;
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct uring *u;
+	size_t sq_len, cq_len;
+	int i;
 
-        if (!todo)
-                return -1;
-	pusoff = (tsp[1] & 0x40) ? tsp[i++] : todo;
-	if (pusoff + i > 188)
-		goto error;
-	if (validcc(p, tsp) && pusoff && p->bufp) {
-	        int rlen = pusoff;
-		if (p->len) {
-			if (p->bufp + rlen > p->len)
-				rlen = p->len - p->bufp;
-		} else
-			if (p->bufp + rlen > 4096)
-				rlen = 4096 - p->bufp;
-		write_secbuf(p, tsp + i, rlen);
-		if (!p->len && p->bufp >= 3 && (p->len = seclen(p->buf)) > 4096)
-			pid_info_reset(p);
-		else
-			pid_info_proc_section(p);
-	}
-	i += pusoff;
-	while ((todo = 188 - i) > 0 && tsp[i] != 0xff) {
-	        pid_info_reset(p);
-		if (todo < 3)
-			fprintf(stderr, "sec start <3 \n");
-		if (todo < 3 || (p->len = seclen(tsp+i)) > todo) {
-			if (p->len > 4096)
-				goto error;
-			write_secbuf(p, tsp+i, todo);
-			i+=todo;
-		} else {
-			write_secbuf(p, tsp+i, p->len);
-			i+=p->len;
-			pid_info_proc_section(p);
-		}
+	u = calloc(1, sizeof(struct uring));
+	if (!u)
+		return -1;
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (u->fd < 0)
+		goto fail;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+		goto fail_fd;
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ring_len = sq_len > cq_len ? sq_len : cq_len;
+	u->ring = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED)
+		goto fail_fd;
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail_ring;
+	u->sq_head = u->ring + p.sq_off.head;
+	u->sq_tail = u->ring + p.sq_off.tail;
+	u->sq_array = u->ring + p.sq_off.array;
+	u->sq_mask = *(unsigned *) (u->ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->cq_head = u->ring + p.cq_off.head;
+	u->cq_tail = u->ring + p.cq_off.tail;
+	u->cqes = u->ring + p.cq_off.cqes;
+	u->cq_mask = *(unsigned *) (u->ring + p.cq_off.ring_mask);
+
+	u->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+		     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->bufs = malloc(URING_BUFS * RTP_SLOT);
+	if (u->br == MAP_FAILED || !u->bufs)
+		goto fail_sqes;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) u->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail_sqes;
+	for (i = 0; i < URING_BUFS; i++)
+		uring_buf_put(u, i);
+	uring_buf_publish(u);
+	u->ev.handler = uring_handler;
+	uring = u;
+	if (uring_probe() < 0) {
+		uring = NULL;
+		goto fail_sqes;
 	}
 	return 0;
 
-error:
-	fprintf(stderr, "error\n");
-	pid_info_reset(p);
+fail_sqes:
+	if (u->br != MAP_FAILED)
+		munmap(u->br, URING_BUFS * sizeof(struct io_uring_buf));
+	free(u->bufs);
+	munmap(u->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+fail_ring:
+	munmap(u->ring, u->ring_len);
+fail_fd:
+	close(u->fd);
+fail:
+	free(u);
 	return -1;
 }
 
 /****************************************************************************/
 
-void proc_tsp(struct ts_info *tsi, uint8_t *tsp)
+static void rtsp_handler(struct evsrc *ev, uint32_t events)
 {
-        uint16_t pid = 0x1fff & ((tsp[1] << 8) | tsp[2]);
-	struct pid_info *pidi = &tsi->pidi[pid];
-
-	if (!pidi->used)
-		return;
-
-	if (!pidi->buf) {
-		pidi->buf = malloc(4096);
-		if (!pidi->buf)
+	struct scantp *stp = container_of(ev, struct scantp, rtsp_ev);
+	struct satipcon *scon = &stp->scon;
+	socklen_t len;
+	int err = 0;
+
+	if (scon->state == RTSP_CONNECT) {
+		len = sizeof(err);
+		if (getsockopt(scon->sock, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+			fprintf(stderr, "Could not connect to %s:%s: %s\n",
+				scon->host, scon->port, strerror(err));
+			scon->error = 1;
 			return;
-		pidi->cc = 0xff;
+		}
+		scon->state = RTSP_SETUP;
+		if (rx_backend == RX_URING) {
+			stp->urtsp = uring_recv_start(stp, scon->sock, 0);
+			if (!stp->urtsp) {
+				scon->error = 1;
+				return;
+			}
+		}
+		/* HTTP has no SETUP */
+		if (scon->http)
+			stp_tune(stp);
 	}
-	pid_info_build_section(pidi, tsp);
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		rtsp_read(stp);
+	if (!scon->error)
+		rtsp_flush(scon);
 }
 
-void proc_tsps(struct ts_info *tsi, uint8_t *tsp, uint32_t len)
+/* the request of an HTTP stream, sent by stp_tune() once connected */
+static int http_get(struct scantp *stp, const char *query)
 {
-    time_t mt = mtime(NULL);
-    struct sfilter *sf, *sfn;
-    int active_filters = 0;
-
-    fprintf(stderr, "Processing TS packets, remaining filters: %d\n", !list_empty(&tsi->sfilters));
-    list_for_each_entry_safe(sf, sfn, &tsi->sfilters, tslink) {
-        if (sf->done) {
-            fprintf(stderr, "Completed filter PID=%u TID=%u EXT=%u\n", sf->pidi->pid, sf->tid, sf->ext);
-            list_del(&sf->tslink);
-        } else if (mt > sf->timeout) {
-            fprintf(stderr, "Timeout exceeded for filter PID=%u TID=%u EXT=%u (todo_set=%d)\n",
-                    sf->pidi->pid, sf->tid, sf->ext, sf->todo_set);
-            // Nie usuwamy filtra od razu, tylko oznaczamy jako wygasły
-            sf->done = 1; // Usunięcie przeniesiemy do `scan_tp`
-        } else {
-            active_filters++;
-        }
-    }
-
-    if (active_filters == 0 && list_empty(&tsi->sfilters)) {
-        fprintf(stderr, "All filters completed or timed out, marking TS as done.\n");
-        tsi->done = 1;
-    }
+	struct satipcon *scon = &stp->scon;
+	char buf[2300];
+	int len;
 
-    while (len >= 188) {
-        proc_tsp(tsi, tsp);
-        tsp += 188;
-        len -= 188;
-    }
+	len = snprintf(buf, sizeof(buf),
+		       "GET /?%s HTTP/1.0\r\n"
+		       "Host: %s:%s\r\n"
+		       "\r\n",
+		       query, scon->host, scon->port);
+	if (len > 0 && len < sizeof(buf))
+		rtsp_queue(scon, buf, len);
+	return 0;
 }
 
-/****************************************************************************/
-/****************************************************************************/
-// Valid till 28.2.2100
-static void get_date_from_mjd(uint16_t mjd, uint16_t *y, uint8_t *m, uint8_t *d)
+/*
+ * PIDs were added to a running HTTP stream: close it, as the server
+ * may need its tuner, and connect again. stp_tune() then sends the
+ * full list.
+ */
+static int http_restart(struct scantp *stp)
 {
-	static int dm[] = {31,30,31,30,31,31,30,31,30,31,31,28};
-	int i,p,r;
-	r = mjd - 51604;  // 0 = 1.3.2000
-	if (r < 0)
-		r += 65536;
-	p = r / (365*4+1);
-	r = r - p * (365*4+1);
-	*y = p * 4 + 2000;
-	p = r / 365;
-	r = r - p * 365;
-	//~ fprintf(stderr, " %d,%d\n",p,r);
-	*y += p;
-	if (p < 4) {
-		for (i = 0; i < 12; i += 1) {
-			*m = i < 10 ? i + 3 : i - 9;
-			if (r < dm[i]) {
-				*d = r + 1;
-				if ( i >= 10 )
-					*y += 1;
-				break;
-			}
-			r -= dm[i];
-		}
-	} else {
-		*m = 2;
-		*d = 29;
+	struct satipcon *scon = &stp->scon;
+	struct sockaddr sadr;
+
+	uring_recv_stop(stp->urtsp);
+	stp->urtsp = NULL;
+	close(scon->sock);
+	scon->rlen = scon->wlen = 0;
+	scon->pending = scon->stale = 0;
+	scon->sock = streamsock(scon->host, scon->port, &sadr);
+	scon->evmask = EPOLLOUT;
+	if (scon->sock < 0 ||
+	    ev_ctl(EPOLL_CTL_ADD, scon->sock, &stp->rtsp_ev, scon->evmask)) {
+		fprintf(stderr, "Could not connect to %s:%s\n", scon->host, scon->port);
+		scon->error = 1;
+		return -1;
 	}
+	scon->state = RTSP_CONNECT;
+	scon->deadline = mtime_ms() + RTSP_TIMEOUT;
+	return 0;
 }
 
-static void print_events(struct tp_info *tpi)
+/*
+ * Datagram slots for recvmmsg(). All sessions share one ring, a batch is
+ * fully processed before the loop reads from the next socket.
+ */
+struct rtp_ring {
+	struct mmsghdr msg[RTP_BATCH];
+	struct iovec iov[RTP_BATCH];
+	uint8_t ctl[RTP_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+	uint8_t buf[RTP_BATCH][RTP_SLOT];
+};
+
+static struct rtp_ring *rxring;
+
+static int rtp_ring_init(void)
 {
-	struct service *s;
-	struct event *e;
-	char t[512];
 	int i;
-	uint16_t y;
-	uint8_t m,d;
-
 
-	list_for_each_entry(s, &tpi->services, link) {
-		list_for_each_entry(e, &s->events, link) {
-			printf("EVENT\n");
-			printf(" ID:%d:%d:%d:%d\n", e->onid, e->tsid, e->sid, e->eid);
-			get_date_from_mjd(e->mjd,&y,&m,&d);
-			printf(" TIME:%04d-%02d-%02dT%02d:%02d:%02dZ\n", y, m, d, e->sh, e->sm, e->ss);
-			printf(" DUR:%02d:%02d:%02d\n", e->dh, e->dm, e->ds);
-			for ( i = 0; i < 3; i += 1) {
-				if( e->s_lang[i] < 0x20 || e->s_lang[i] >= 0x7F )
-					 e->s_lang[i] = '?';
-			}
-			printf(" LANG:%c%c%c\n", e->s_lang[0], e->s_lang[1], e->s_lang[2]);
-			if( e->s_name ) {
-				en300468_parse_string_to_utf8(t,&e->s_name[1],e->s_name[0]);
-				printf(" NAME:%s\n",t);
-			}
-			if( e->s_text ) {
-				en300468_parse_string_to_utf8(t,&e->s_text[1],e->s_text[0]);
-				printf(" TEXT:%s\n",t);
-			}
-			printf("END\n");
-		}
+	rxring = calloc(1, sizeof(struct rtp_ring));
+	if (!rxring)
+		return -1;
+	for (i = 0; i < RTP_BATCH; i++) {
+		rxring->iov[i].iov_base = rxring->buf[i];
+		rxring->iov[i].iov_len = RTP_SLOT;
+		rxring->msg[i].msg_hdr.msg_iov = &rxring->iov[i];
+		rxring->msg[i].msg_hdr.msg_iovlen = 1;
+		rxring->msg[i].msg_hdr.msg_control = rxring->ctl[i];
 	}
+	return 0;
 }
 
+static void rtp_ring_reset(struct rtp_ring *r)
+{
+	int i;
 
+	for (i = 0; i < RTP_BATCH; i++)
+		r->msg[i].msg_hdr.msg_controllen = sizeof(r->ctl[i]);
+}
 
-static void print_services(struct scantp *stp)
+static void rtp_drops(struct scantp *stp, struct msghdr *mh)
 {
-    struct tp_info *tpi = stp->tpi;
-    struct satipcon *scon = &stp->scon;
-    struct service *s;
-    int i;
-    
-    if (szfilename[0])
-        fp = fopen(szfilename, "a");
-    
-    list_for_each_entry(s, &tpi->services, link) {
-        char szPIDs[512];
-        char szTemp[1024];
-        size_t pids_len = 0; // Długość aktualnie zapisanych danych w szPIDs
+	struct cmsghdr *cm;
 
-        memset(szPIDs, 0, sizeof(szPIDs));
-        memset(szTemp, 0, sizeof(szTemp));
-        
-        if (s->got_pmt && (s->vpid != 0 || s->anum > 0)) {
-            printf("SERVICE\n");
-            printf(" PNAME:%s\n", s->pname);
-            printf(" SNAME:%s\n", s->name);
-            printf(" ONID:%d\n", s->onid);
-            printf(" TSID:%d\n", s->tsid);
-            printf(" SID:%d\n", s->sid);
-            printf(" PIDS:%d", s->pmt);
+	for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL)
+			memcpy(&stp->rx_drops, CMSG_DATA(cm), sizeof(uint32_t));
+}
 
-            snprintf(szTemp, sizeof(szTemp), "0,%d", s->pmt);
-            pids_len = strlen(szPIDs);
-            strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
+/* hand one recvmmsg() batch to the demuxer */
+static void proc_rtp_batch(struct scantp *stp, struct rtp_ring *r, int n)
+{
+	struct msghdr *mh;
+	int i, len;
+
+	for (i = 0; i < n; i++) {
+		mh = &r->msg[i].msg_hdr;
+		len = r->msg[i].msg_len;
+		if (mh->msg_controllen)
+			rtp_drops(stp, mh);
+		if (len > 0 && !(mh->msg_flags & MSG_TRUNC))
+			rtp_input(stp, r->buf[i], len);
+	}
+	stp->rx_datagrams += n;
+}
 
-            uint16_t pcr = s->pcr;
-            if (s->pmt == pcr) pcr = 0;
-            if (s->vpid != 0) {
-                printf(",%d", s->vpid);
-                snprintf(szTemp, sizeof(szTemp), ",%d", s->vpid);
-                pids_len = strlen(szPIDs);
-                strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
-                if (s->vpid == pcr) pcr = 0;
-            }
-            for (i = 0; i < s->anum; i += 1) {
-                if (s->apid[i] != 0) {
-                    printf(",%d", s->apid[i]);
-                    snprintf(szTemp, sizeof(szTemp), ",%d", s->apid[i]);
-                    pids_len = strlen(szPIDs);
-                    strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
-                    if (s->apid[i] == pcr) pcr = 0;
-                }
-            }
-            if (s->sub != 0) {
-                printf(",%d", s->sub);
-                snprintf(szTemp, sizeof(szTemp), ",%d", s->sub);
-                pids_len = strlen(szPIDs);
-                strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
-                if (s->sub == pcr) pcr = 0;
-            }
-            if (s->ttx != 0) {
-                printf(",%d", s->ttx);
-                snprintf(szTemp, sizeof(szTemp), ",%d", s->ttx);
-                pids_len = strlen(szPIDs);
-                strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
-                if (s->ttx == pcr) pcr = 0;
-            }
-            if (pcr != 0) {
-                printf(",%d", pcr);
-                snprintf(szTemp, sizeof(szTemp), ",%d", pcr);
-                pids_len = strlen(szPIDs);
-                strncat(szPIDs, szTemp, sizeof(szPIDs) - pids_len - 1);
-            }
-            printf("\n");
-            if (s->anum > 0 && s->apid[0] != 0) {
-                printf(" APIDS:%d", s->apid[0]);
-                for (i = 1; i < s->anum; i += 1) {
-                    if (s->apid[i] != 0) {
-                        printf(",%d", s->apid[i]);
-                    }
-                }
-            }
-            printf("\n");
-            if (s->vpid == 0)
-                printf(" RADIO:1\n");
-            if (s->ca_mode)
-                printf(" ENC:1\n");
-            printf(" EIT:%d%d\n", s->eit_pf, s->eit_sched);
-            printf("END\n");
-            
-            switch (tpi->msys) 
-            {
-                case 1: // DVB-C
-                    snprintf(szTemp, sizeof(szTemp), "#EXTINF:-1,%s\nrtsp://%s:%s/?freq=%u&msys=dvbc&sr=%u&mtype=%s&pids=%s\n", 
-                             s->name, scon->host, scon->port, tpi->freq, tpi->sr, mtype2str[tpi->mod], szPIDs);
-                    break;
-                case 3: // DVB-T
-                    snprintf(szTemp, sizeof(szTemp), "#EXTINF:-1,%s\nrtsp://%s:%s/?freq=%u&msys=dvbt&bw=%s&tmode=%s&gi=%s&pids=%s\n", 
-                             s->name, scon->host, scon->port, tpi->freq, bw2str[tpi->bw], tmode2str[tpi->tmode], gi2str[tpi->gi], szPIDs);
-                    break;
-                case 5: // DVB-S
-                case 6: // DVB-S2
-                    snprintf(szTemp, sizeof(szTemp), "#EXTINF:-1,%s\nrtsp://%s:%s/?src=%u&freq=%u&pol=%s&ro=%s&msys=%s&mtype=%s&plts=%s&sr=%u&fec=%s&pids=%s\n", 
-                             s->name, scon->host, scon->port, tpi->src, tpi->freq, pol2str[tpi->pol], roll2str[tpi->ro], msys2str[tpi->msys], mtype2str[tpi->mod], pilot2str[0], tpi->sr, fec2str[tpi->fec], szPIDs);
-                    break;
-                case 16: // DVB-T2
-                    snprintf(szTemp, sizeof(szTemp), "#EXTINF:-1,%s\nrtsp://%s:%s/?freq=%u&msys=dvbt2&bw=%s&tmode=%s&gi=%s&pids=%s\n", 
-                             s->name, scon->host, scon->port, tpi->freq, bw2str[tpi->bw], tmode2str[tpi->tmode], gi2str[tpi->gi], szPIDs);
-                    break;
-                case 19: // DVB-C2
-                    snprintf(szTemp, sizeof(szTemp), "#EXTINF:-1,%s\nrtsp://%s:%s/?freq=%u&msys=dvbc2&sr=%u&mtype=%s&pids=%s\n", 
-                             s->name, scon->host, scon->port, tpi->freq, tpi->sr, mtype2str[tpi->mod], szPIDs);
-                    break;
-            }
-            printf("%s", szTemp);
-            if (szfilename[0])
-                fprintf(fp, "%s", szTemp);
-            fflush(stdout);
-        }
-    }
-    if (szfilename[0])
-        fclose(fp);
+static void rtp_handler(struct evsrc *ev, uint32_t events)
+{
+	struct scantp *stp = container_of(ev, struct scantp, rtp_ev);
+	int64_t now = mtime_ms();
+	int i, n;
+
+	/* bounded, so one busy mux cannot starve the other sessions */
+	for (i = 0; i < 4; i++) {
+		rtp_ring_reset(rxring);
+		n = recvmmsg(stp->scon.usock, rxring->msg, RTP_BATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0)
+			break;
+		/* a retuned session may still get datagrams of the previous mux */
+		if (stp->scon.state != RTSP_RUNNING)
+			continue;
+		rtp_data(stp, now);
+		proc_rtp_batch(stp, rxring, n);
+		if (n < RTP_BATCH)
+			break;
+	}
 }
 
-static int scan_tp(struct scantp *stp)
+/* a few reports per second, plain recv() is good enough */
+static void rtcp_handler(struct evsrc *ev, uint32_t events)
 {
-    struct scanip *sip = stp->sip;
-    struct satipcon *scon = &stp->scon;
-    fd_set fds;
-    struct timeval timeout;
-    int mfd, num, n;
-    time_t last_data_time = mtime(NULL); // Czas ostatniego odbioru danych
-    char buf[2048];
-    struct sockaddr sadr;
-    int rbuf = 1024 * 1024;
-    int pat_done = 0, sdt_done = 0, nit_done = !stp->tpi->use_nit; // NIT opcjonalny
-
-    scon->seq = 0;
-    scon->usock = udpsock(&sadr, "0");
-    if (scon->usock < 0) {
-        fprintf(stderr, "Could not get UDP socket\n");
-        return -1;
-    }
-    scon->nsport = 0;
-    if (scon->nsport == 0) {
-        struct sockaddr_in sin;
-        socklen_t len = sizeof(sin);
-        getsockname(scon->usock, (struct sockaddr*) &sin, &len);
-        scon->nsport = ntohs(sin.sin_port);
-    }
+	struct scantp *stp = container_of(ev, struct scantp, rtcp_ev);
+	uint8_t buf[RTP_SLOT];
+	int n;
 
-    scon->sock = streamsock(scon->host, scon->port, &sadr);
-    if (scon->sock < 0)
-        return scon->sock;
+	while ((n = recv(stp->scon.csock, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+		rtcp_input(stp, buf, n);
+}
 
-    send_setup(scon->sock, scon->host, scon->port, scon->tune, &scon->seq, scon->nsport, 0);
-    if (check_ok(scon->sock, scon->sid, &scon->strid) < 0)
-        return 0;
-    update_pids(&stp->tsi);
-    if (check_ok(scon->sock, scon->sid, &scon->strid) < 0)
-        return 0;
+/*
+ * RTCP goes to the RTP port + 1. No SO_REUSEADDR here, so the bind
+ * fails when another socket already has the port.
+ */
+static int rtcpsock(uint16_t port)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	int sock;
 
-    add_sfilter(&stp->tsi, 0x00, 0x00, 0, 0, 60); // PAT, timeout 60s
-    add_sfilter(&stp->tsi, 0x11, 0x42, 0, 1, 60); // SDT, timeout 60s
-    if (stp->tpi->use_nit) {
-        add_sfilter(&stp->tsi, 0x10, 0x40, 0, 1, 120); // NIT, timeout 120s
-    }
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return -1;
+	if (bind(sock, (struct sockaddr *) &sin, sizeof(sin))) {
+		close(sock);
+		return -1;
+	}
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	return sock;
+}
 
-    stp->timeout = mtime(NULL) + 300; // Początkowy timeout 5 minut
-
-    while (!done && !stp->tsi.done) {
-        time_t now = mtime(NULL);
-        mfd = 0;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        FD_ZERO(&fds);
-        add_fd(scon->sock, &mfd, &fds);
-        add_fd(scon->usock, &mfd, &fds);
-        num = select(mfd + 1, &fds, NULL, NULL, &timeout);
-        if (num < 0)
-            break;
+/*
+ * Returns the effective receive buffer size. Linux reports twice the
+ * requested value to account for its bookkeeping overhead.
+ */
+static int rtp_sockopts(int sock)
+{
+	int one = 1, val = rtp_rcvbuf;
+	socklen_t len = sizeof(val);
 
-        if (FD_ISSET(scon->sock, &fds)) {
-            n = recv(scon->sock, buf, sizeof(buf), 0);
-        }
-        if (FD_ISSET(scon->usock, &fds)) {
-            n = recvfrom(scon->usock, buf, sizeof(buf), 0, 0, 0);
-            if (n > 12) {
-                proc_tsps(&stp->tsi, buf + 12, n - 12);
-                last_data_time = now;
-                stp->timeout = now + 60; // Przedłuż timeout o 60s po każdym pakiecie
-            }
-        }
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)))
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+	setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+	if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, &len))
+		return 0;
+	return val / 2;
+}
 
-        // Sprawdzanie stanu filtrów
-        struct sfilter *sf;
-        list_for_each_entry(sf, &stp->tsi.sfilters, tslink) {
-            if (sf->tid == 0x00 && sf->done) pat_done = 1;
-            if (sf->tid == 0x42 && sf->done) sdt_done = 1;
-            if (sf->tid == 0x40 && sf->done) nit_done = 1;
-        }
+static void check_rcvbuf(void)
+{
+	struct sockaddr sadr;
+	int sock, val;
 
-        // Zakończ, jeśli kluczowe filtry są gotowe i brak danych przez 30s
-        if (pat_done && sdt_done && nit_done && now > last_data_time + 30) {
-            fprintf(stderr, "PAT, SDT, and NIT completed, no data for 30s, finishing scan.\n");
-            stp->tsi.done = 1;
-        }
-        // Maksymalny timeout 5 minut
-        if (now > stp->timeout) {
-            fprintf(stderr, "Maximum timeout reached, cleaning up filters and finishing scan.\n");
-            struct sfilter *sfn; // Deklaracja sfn dla list_for_each_entry_safe
-            list_for_each_entry_safe(sf, sfn, &stp->tsi.sfilters, tslink) {
-                if (!sf->done) {
-                    fprintf(stderr, "Force removing filter PID=%u TID=%u EXT=%u\n",
-                            sf->pidi->pid, sf->tid, sf->ext);
-                    list_del(&sf->tslink);
-                }
-            }
-            stp->tsi.done = 1;
-        }
-    }
+	sock = udpsock(&sadr, "0");
+	if (sock < 0)
+		return;
+	val = rtp_sockopts(sock);
+	close(sock);
+	if (val < rtp_rcvbuf)
+		fprintf(stderr, "UDP receive buffer limited to %d kB (wanted %d kB), "
+			"raise net.core.rmem_max to avoid drops\n",
+			val / 1024, rtp_rcvbuf / 1024);
+}
+
+/* set up the receive backend, called with the event loop fd open */
+static int rx_init(void)
+{
+	if (!rxring && rtp_ring_init() < 0)
+		return -1;
+	if (rx_backend != RX_URING || uring)
+		return 0;
+	if (uring_init() < 0 ||
+	    ev_ctl(EPOLL_CTL_ADD, uring->fd, &uring->ev, EPOLLIN) < 0) {
+		fprintf(stderr, "io_uring multishot receive not available, using recvmmsg\n");
+		rx_backend = RX_RECVMMSG;
+	}
+	return 0;
+}
+
+static int stp_start(struct scantp *stp, struct tp_info *tpi)
+{
+	struct scanip *sip = stp->sip;
+	struct satipcon *scon = &stp->scon;
+	struct sockaddr sadr;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int i;
+
+	memset(stp, 0, sizeof(struct scantp));
+	ts_info_init(&stp->tsi);
+	stp->sip = sip;
+	stp->tpi = tpi;
+	stp->tsi.stp = stp;
+	stp->rtsp_ev.handler = rtsp_handler;
+	stp->rtp_ev.handler = rtp_handler;
+	stp->rtcp_ev.handler = rtcp_handler;
+	scon->port = sip->port;
+	scon->host = sip->host;
+	tpstring(tpi, &scon->tune[0], sizeof(scon->tune));
+	scon->tcp = sip->tcp;
+	scon->http = sip->http;
+	scon->usock = scon->csock = -1;
+
+	/* a few tries for an RTP port with a free one above for RTCP */
+	for (i = 0; !scon->tcp && !scon->http && scon->csock < 0 && i < 8; i++) {
+		if (scon->usock >= 0)
+			close(scon->usock);
+		scon->usock = udpsock(&sadr, "0");
+		if (scon->usock < 0) {
+			fprintf(stderr, "Could not get UDP socket\n");
+			goto fail;
+		}
+		getsockname(scon->usock, (struct sockaddr*) &sin, &len);
+		scon->nsport = ntohs(sin.sin_port);
+		if (scon->nsport < 0xffff)
+			scon->csock = rtcpsock(scon->nsport + 1);
+	}
+	if (scon->usock >= 0) {
+		fcntl(scon->usock, F_SETFL, O_NONBLOCK);
+		rtp_sockopts(scon->usock);
+	}
+
+	scon->sock = streamsock(scon->host, scon->port, &sadr);
+	if (scon->sock < 0) {
+		fprintf(stderr, "Could not connect to %s:%s\n", scon->host, scon->port);
+		goto fail_udp;
+	}
+	scon->evmask = EPOLLOUT;
+	if (scon->usock >= 0 && rx_backend == RX_URING)
+		stp->urtp = uring_recv_start(stp, scon->usock, 1);
+	if ((scon->usock >= 0 && (rx_backend == RX_URING ? !stp->urtp :
+	     ev_ctl(EPOLL_CTL_ADD, scon->usock, &stp->rtp_ev, EPOLLIN) < 0)) ||
+	    (scon->csock >= 0 &&
+	     ev_ctl(EPOLL_CTL_ADD, scon->csock, &stp->rtcp_ev, EPOLLIN) < 0) ||
+	    ev_ctl(EPOLL_CTL_ADD, scon->sock, &stp->rtsp_ev, scon->evmask)) {
+		uring_recv_stop(stp->urtp);
+		close(scon->sock);
+		goto fail_udp;
+	}
+	scon->state = RTSP_CONNECT;
+	scon->deadline = mtime_ms() + RTSP_TIMEOUT;
+	stp->tune_start = mtime_ms();
+	tpi->epg_since = stp->tune_start;
+	/* HTTP sends its GET once connected, see rtsp_handler() */
+	if (!scon->http)
+		send_setup(scon, scon->nsport, 0);
+	sip->active++;
+	return 0;
 
-    if (stp->tpi->scan_eit)
-        print_events(stp->tpi);
-    else
-        print_services(stp);
+fail_udp:
+	if (scon->usock >= 0)
+		close(scon->usock);
+	if (scon->csock >= 0)
+		close(scon->csock);
+fail:
+	ts_info_release(&stp->tsi);
+	return -1;
+}
 
-    send_teardown(scon->sock, scon->host, scon->port, scon->strid, &scon->seq, scon->sid);
-    close(scon->sock);
-    close(scon->usock);
+/* --daemon: the transponder goes back to the end of the queue */
+static void stp_requeue(struct scantp *stp)
+{
+	struct tp_info *tpi = stp->tpi;
 
-    return 0;
+	if (!daemon_dwell)
+		return;
+	if (tpi->epg_since)
+		tpi->epg_tuned_ms += mtime_ms() - tpi->epg_since;
+	tpi->epg_since = 0;
+	if (done)
+		return;
+	list_del(&tpi->link);
+	list_add_tail(&tpi->link, &stp->sip->tps);
+}
+
+static void stp_close(struct scantp *stp)
+{
+	struct satipcon *scon = &stp->scon;
+
+	stp_requeue(stp);
+	if (daemon_dwell && scon->error)
+		stp->sip->retry_at = mtime_ms() + DAEMON_RETRY_MS;
+
+	uring_recv_stop(stp->urtp);
+	uring_recv_stop(stp->urtsp);
+	stp->urtp = stp->urtsp = NULL;
+	if (scon->usock >= 0)
+		close(scon->usock);
+	if (scon->csock >= 0)
+		close(scon->csock);
+	close(scon->sock);
+	ts_info_release(&stp->tsi);
+	free(stp->rseq.win);
+	stp->rseq.win = NULL;
+	scon->state = RTSP_IDLE;
+	stp->sip->active--;
+	stp->sip->scanned++;
+}
+
+/*
+ * --keep_session: switch the session to the next queued transponder
+ * with a PLAY on the same stream instead of TEARDOWN and a new SETUP.
+ */
+static int stp_retune(struct scantp *stp)
+{
+	struct scanip *sip = stp->sip;
+	struct tp_info *tpi;
+
+	if (!keep_session || done || stp->scon.error || stp->scon.http ||
+	    list_empty(&sip->tps))
+		return -1;
+	stp_requeue(stp);
+	tpi = list_first_entry(&sip->tps, struct tp_info, link);
+	list_del(&tpi->link);
+	list_add(&tpi->link, &sip->tps_done);
+	sip->scanned++;
+
+	ts_info_release(&stp->tsi);
+	memset(&stp->tsi, 0, sizeof(stp->tsi));
+	ts_info_init(&stp->tsi);
+	stp->tsi.stp = stp;
+	stp->tpi = tpi;
+	stp->tuned = 0;
+	stp->collected = 0;
+	stp->pat_ms = 0;
+	stp->rx_datagrams = 0;
+	stp->sig_reports = stp->sig_lock = 0;
+	rtp_seq_reset(&stp->rseq);
+	tpstring(tpi, &stp->scon.tune[0], sizeof(stp->scon.tune));
+	stp->tune_start = mtime_ms();
+	tpi->epg_since = stp->tune_start;
+	stp->scon.stale = stp->scon.pending;
+	stp_tune(stp);
+	return 0;
+}
+
+/* print results and send TEARDOWN, the session closes on the reply */
+static void stp_finish(struct scantp *stp)
+{
+	struct satipcon *scon = &stp->scon;
+
+	/* with --epg the events are already out, --daemon keeps them for --epgdb */
+	if (!stp->tpi->scan_eit || (!epg_fmt && !daemon_dwell)) {
+		printf("\nTUNE:%s\n", scon->tune);
+		if (stp->sig_reports)
+			printf("SIGNAL:level=%d,lock=%d,quality=%d\n",
+			       stp->sig_level, stp->sig_lock, stp->sig_quality);
+		if (stp->tpi->scan_eit)
+			print_events(stp->tpi);
+		else
+			print_services(stp);
+		fflush(stdout);
+	}
+	fprintf(stderr, "RTP %s: %llu datagrams, %u dropped by kernel, %d PID updates\n",
+		scon->tune, (unsigned long long) stp->rx_datagrams, stp->rx_drops,
+		stp->tsi.pid_updates);
+	fprintf(stderr, "RTP %s: %u lost, %u reordered, %u late, %u bad headers\n",
+		scon->tune, stp->rseq.lost, stp->rseq.reordered, stp->rseq.late,
+		stp->rseq.bad);
+	if (stp->pat_ms) {
+		stp->sip->pats++;
+		stp->sip->pat_ms += stp->pat_ms - 1;
+	}
+
+	if (!stp_retune(stp))
+		return;
+	/* an HTTP stream ends with its connection */
+	if (scon->http) {
+		stp_close(stp);
+		return;
+	}
+	uring_recv_stop(stp->urtp);
+	stp->urtp = NULL;
+	if (scon->usock >= 0)
+		close(scon->usock);
+	if (scon->csock >= 0)
+		close(scon->csock);
+	scon->usock = scon->csock = -1;
+	send_teardown(scon);
+	scon->state = RTSP_TEARDOWN;
+	scon->deadline = mtime_ms() + RTSP_TIMEOUT;
+}
+
+/* when to give up on a tuner that reports no lock and sends no data */
+static int64_t stp_lock_deadline(struct scantp *stp)
+{
+	if (!lock_wait || stp->tuned || !stp->sig_reports || stp->sig_lock)
+		return INT64_MAX;
+	return stp->tune_start + lock_wait;
+}
+
+/*
+ * --daemon: a session stays on its transponder while nothing else
+ * waits for the tuner. Otherwise it moves on once the tables are
+ * complete or after the dwell time. A stream without data for the
+ * data timeout is restarted later.
+ */
+static int stp_rotate(struct scantp *stp, int64_t now)
+{
+	if (!daemon_dwell)
+		return 0;
+	if (now >= stp->timeout)
+		return 1;
+	return !list_empty(&stp->sip->tps) &&
+	       (stp->tsi.done || now >= stp->tune_start + daemon_dwell * 1000LL);
+}
+
+static void stp_check(struct scantp *stp, int64_t now)
+{
+	struct satipcon *scon = &stp->scon;
+	struct sfilter *sf, *sfn;
+
+	if (scon->state == RTSP_IDLE)
+		return;
+	if (scon->error || (scon->state == RTSP_TEARDOWN && !scon->pending)) {
+		stp_close(stp);
+		return;
+	}
+	if (scon->deadline && now >= scon->deadline) {
+		if (scon->state != RTSP_TEARDOWN)
+			fprintf(stderr, "RTSP timeout for %s\n", scon->tune);
+		stp_close(stp);
+		return;
+	}
+	if (scon->state != RTSP_RUNNING) {
+		if (done)
+			stp_close(stp);
+		return;
+	}
+
+	/* the tuner keeps telling it has no lock, no point waiting for tables */
+	if (now >= stp_lock_deadline(stp)) {
+		fprintf(stderr, "No lock on %s after %lld ms (level %d), skipping\n",
+			scon->tune, (long long) (now - stp->tune_start), stp->sig_level);
+		stp->sip->nolock++;
+		list_for_each_entry_safe(sf, sfn, &stp->tsi.sfilters, tslink)
+			sfilter_done(sf);
+		stp_finish(stp);
+		return;
+	}
+	if (stp->tsi.pids_dirty && now >= stp->tsi.pids_deadline)
+		update_pids(&stp->tsi);
+	while (stp->rseq.held && now >= stp->rseq.held_since + RTP_HOLD_MS)
+		rtp_skip_gap(stp);
+	if (!stp->tsi.done)
+		ts_info_check_filters(&stp->tsi, now);
+
+	// Maksymalny timeout 5 minut
+	if (!stp->tsi.done && now >= stp->timeout) {
+		fprintf(stderr, "Maximum timeout reached, cleaning up filters and finishing scan.\n");
+		list_for_each_entry_safe(sf, sfn, &stp->tsi.sfilters, tslink) {
+			fprintf(stderr, "Force removing filter PID=%u TID=%u EXT=%u\n",
+				sf->pidi->pid, sf->tid, sf->ext);
+			sfilter_done(sf);
+		}
+		stp->tsi.done = 1;
+	}
+	if (stp->tsi.done && !stp->collected) {
+		stp->collected = 1;
+		fprintf(stderr, "Tables of %s done after %lld ms\n", scon->tune,
+			(long long) (now - stp->tune_start));
+	}
+	if (stp->tsi.done)
+		stp->tpi->epg_fresh = now;
+	if (done || (stp->tsi.done && !daemon_dwell) || stp_rotate(stp, now))
+		stp_finish(stp);
+}
+
+/* next time stp_check() has something to do for this session */
+static int64_t stp_deadline(struct scantp *stp)
+{
+	struct satipcon *scon = &stp->scon;
+	int64_t t = INT64_MAX;
+
+	if (scon->state == RTSP_IDLE)
+		return t;
+	if (scon->deadline)
+		t = scon->deadline;
+	if (scon->state != RTSP_RUNNING)
+		return t;
+	t = min64(t, stp->timeout);
+	t = min64(t, stp_lock_deadline(stp));
+	if (stp->tsi.pids_dirty)
+		t = min64(t, stp->tsi.pids_deadline);
+	if (stp->rseq.held)
+		t = min64(t, stp->rseq.held_since + RTP_HOLD_MS);
+	if (stp->tsi.done && !daemon_dwell)
+		return 0;
+	if (daemon_dwell && !list_empty(&stp->sip->tps))
+		t = min64(t, stp->tsi.done ? 0 : stp->tune_start + daemon_dwell * 1000LL);
+	if (stp->tsi.heap_len)
+		t = min64(t, stp->tsi.heap[0]->timeout);
+	return t;
 }
+
 void tpstring(struct tp_info *tpi, char *s, int slen)
 {
     int len;
@@ -2082,47 +5425,203 @@ void tpstring(struct tp_info *tpi, char *s, int slen)
     }
 }
 
-static int scanip(struct scanip *sip)
+/* start queued transponders on idle tuners */
+static void scanip_fill(struct scanip *sip)
 {
-	struct scantp *stp;
-	struct ts_info *tsi;
 	struct tp_info *tpi;
+	int i;
 
-	while (!done && !list_empty(&sip->tps)) {
-		stp = &sip->stp;
-		memset(stp, 0, sizeof(struct scantp));
-
-		tsi = &stp->tsi;
-		ts_info_init(tsi);
-		stp->sip = sip;
-		stp->scon.port = "554";
-		stp->scon.host = sip->host;
-		tsi->stp = stp;
-
+	if (sip->retry_at > mtime_ms())
+		return;
+	for (i = 0; i < sip->tuners && !done && !list_empty(&sip->tps); i++) {
+		if (sip->stp[i].scon.state != RTSP_IDLE)
+			continue;
 		tpi = list_first_entry(&sip->tps, struct tp_info, link);
-		tpstring(tpi, &stp->scon.tune[0], sizeof(stp->scon.tune));
-		printf("\nTUNE:%s\n", stp->scon.tune);
-		fflush(stdout);
-		stp->tpi = tpi;
-		scan_tp(stp);
-		ts_info_release(tsi);
 		list_del(&tpi->link);
 		list_add(&tpi->link, &sip->tps_done);
+		if (stp_start(&sip->stp[i], tpi) < 0) {
+			sip->scanned++;
+			if (daemon_dwell) {
+				list_del(&tpi->link);
+				list_add_tail(&tpi->link, &sip->tps);
+				sip->retry_at = mtime_ms() + DAEMON_RETRY_MS;
+				return;
+			}
+		}
 	}
 }
 
+/* --daemon: freshness and section rates of every transponder */
+static void daemon_print_stats(struct scanip *sips, int nsips, int64_t now)
+{
+	struct list_head *lists[2];
+	struct tp_info *tpi;
+	char tune[256], fresh[48];
+	int64_t ms;
+	int i, j;
+
+	for (i = 0; i < nsips; i++) {
+		lists[0] = &sips[i].tps_done;
+		lists[1] = &sips[i].tps;
+		for (j = 0; j < 2; j++) {
+			list_for_each_entry(tpi, lists[j], link) {
+				ms = tpi->epg_tuned_ms + (tpi->epg_since ? now - tpi->epg_since : 0);
+				tpstring(tpi, tune, sizeof(tune));
+				if (tpi->epg_fresh)
+					snprintf(fresh, sizeof(fresh), "complete %lld s ago",
+						 (long long) (now - tpi->epg_fresh) / 1000);
+				else
+					snprintf(fresh, sizeof(fresh), "not complete yet");
+				fprintf(stderr, "EPG %s: %s, %llu sections (%.1f/s tuned), "
+					"%llu parsed, %u version changes\n", tune, fresh,
+					(unsigned long long) tpi->epg_sections,
+					ms ? tpi->epg_sections * 1000.0 / ms : 0.0,
+					(unsigned long long) tpi->epg_parsed, tpi->epg_changes);
+			}
+		}
+	}
+}
+
+/*
+ * Single threaded event loop driving all tuners of all servers.
+ * A transponder is moved to tps_done when it is started, so that
+ * add_tp() from a concurrent NIT does not queue it a second time.
+ */
+static int scanip(struct scanip *sips, int nsips)
+{
+	struct epoll_event evs[64];
+	struct evsrc *ev;
+	struct scanip *sip;
+	int64_t start = mtime_ms(), now, next, stats = start + DAEMON_STATS_MS;
+	int64_t dbwrite = start + EPGDB_MS;
+	int i, j, n, busy, scanned = 0, res = 0;
+
+	check_rcvbuf();
+	epfd = epoll_create1(0);
+	if (epfd < 0 || rx_init() < 0)
+		return -1;
+	while (1) {
+		busy = 0;
+		next = INT64_MAX;
+		now = mtime_ms();
+		for (i = 0; i < nsips; i++) {
+			sip = &sips[i];
+			scanip_fill(sip);
+			busy += sip->active;
+			for (j = 0; j < sip->tuners; j++)
+				next = min64(next, stp_deadline(&sip->stp[j]));
+			if (sip->retry_at > now)
+				next = min64(next, sip->retry_at);
+		}
+		/* a daemon waits for its retries until stopped */
+		if (!busy && (!daemon_dwell || done))
+			break;
+		if (daemon_dwell) {
+			if (now >= stats) {
+				daemon_print_stats(sips, nsips, now);
+				stats = now + DAEMON_STATS_MS;
+			}
+			next = min64(next, stats);
+			epgdb_reap(0);
+			if (epgdb_path && eit_changes != epgdb_written) {
+				if (now >= dbwrite) {
+					epgdb_write_bg(sips, nsips);
+					dbwrite = now + EPGDB_MS;
+				}
+				next = min64(next, dbwrite);
+			}
+		}
+		now = mtime_ms();
+		n = epoll_wait(epfd, evs, 64, next == INT64_MAX ? -1 :
+			       next > now ? next - now : 0);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			res = -1;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			ev = evs[i].data.ptr;
+			ev->handler(ev, evs[i].events);
+		}
+		now = mtime_ms();
+		for (i = 0; i < nsips; i++)
+			for (j = 0; j < sips[i].tuners; j++)
+				stp_check(&sips[i].stp[j], now);
+	}
+	uring_drain();
+	close(epfd);
+	epfd = -1;
+
+	for (i = 0; i < nsips; i++)
+		scanned += sips[i].scanned;
+	fprintf(stderr, "Scanned %d transponders on %d server(s) with %d tuner(s) each in %.1f s\n",
+		scanned, nsips, tuners, (mtime_ms() - start) / 1000.0);
+	if (daemon_dwell)
+		daemon_print_stats(sips, nsips, mtime_ms());
+	tcycle_stats(sips, nsips);
+	secbuf_print_stats();
+	sec_print_stats();
+	for (i = 0, n = 0, now = 0; i < nsips; i++) {
+		n += sips[i].tunes;
+		now += sips[i].tune_ms;
+	}
+	if (n)
+		fprintf(stderr, "Average %s to first data: %lld ms\n",
+			keep_session ? "retune" : "SETUP", (long long) (now / n));
+	for (i = 0, n = 0, now = 0; i < nsips; i++) {
+		n += sips[i].pats;
+		now += sips[i].pat_ms;
+	}
+	if (n)
+		fprintf(stderr, "Average tune to first PAT: %lld ms\n", (long long) (now / n));
+	for (i = 0, n = 0; i < nsips; i++)
+		n += sips[i].nolock;
+	if (n)
+		fprintf(stderr, "Skipped %d transponder(s) without lock within %d ms\n",
+			(int) n, lock_wait);
+	return res;
+}
+
 void term_action(int sig, siginfo_t *si, void *d)
 {
 	done = 1;
 }
 
 
-void scanip_init(struct scanip *sip, char *host)
+int scanip_init(struct scanip *sip, char *host)
 {
+	char *p;
+	int i;
+
 	list_head_init(&sip->tps);
 	list_head_init(&sip->tps_done);
 	sip->done = 0;
+	/*
+	 * <ip>/tcp asks for RTP interleaved on the RTSP connection,
+	 * <ip>/http[:port] for HTTP streaming without RTSP
+	 */
+	sip->tcp = sip->http = 0;
+	sip->port = "554";
+	p = strrchr(host, '/');
+	if (p && !strcasecmp(p + 1, "tcp"))
+		sip->tcp = 1;
+	else if (p && !strncasecmp(p + 1, "http", 4) && (!p[5] || p[5] == ':')) {
+		sip->http = 1;
+		sip->port = p[5] ? p + 6 : "80";
+	} else if (!p || strcasecmp(p + 1, "udp"))
+		p = NULL;
+	if (p)
+		*p = 0;
 	sip->host = host;
+	sip->tuners = tuners;
+	sip->active = 0;
+	sip->scanned = 0;
+	sip->stp = calloc(sip->tuners, sizeof(struct scantp));
+	if (!sip->stp)
+		return -1;
+	for (i = 0; i < sip->tuners; i++)
+		sip->stp[i].sip = sip;
+	return 0;
 }
 
 void scanip_release(struct scanip *sip)
@@ -2137,6 +5636,7 @@ void scanip_release(struct scanip *sip)
 		list_del(&p->link);
 		free_tp_info(p);
 	}
+	free(sip->stp);
 }
 
 void scan_cable(struct scanip *sip)
@@ -2156,11 +5656,355 @@ void scan_cable(struct scanip *sip)
 		}
 }
 
+/****************************************************************************/
+/* benchmarks (--bench) */
+
+#define BENCH_SECS 5
+#define BENCH_MBIT 60
+
+/* a TS capture, or a synthetic mux of a PAT and null packets */
+static uint8_t *bench_load(const char *file, size_t *len)
+{
+	uint8_t *ts, *p;
+	struct stat st;
+	uint32_t crc;
+	int fd, i;
+
+	if (file) {
+		fd = open(file, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < 188 * 7) {
+			fprintf(stderr, "Could not read %s\n", file);
+			return NULL;
+		}
+		*len = st.st_size - st.st_size % (188 * 7);
+		ts = malloc(*len);
+		if (ts && read(fd, ts, *len) != *len) {
+			free(ts);
+			ts = NULL;
+		}
+		close(fd);
+		return ts;
+	}
+	*len = 188 * 7 * 64;
+	ts = malloc(*len);
+	if (!ts)
+		return NULL;
+	for (i = 0; i < *len / 188; i++) {
+		p = ts + i * 188;
+		memset(p, 0xff, 188);
+		p[0] = 0x47;
+		p[3] = 0x10 | (i & 0x0f);
+		if (i % 7) {
+			p[1] = 0x1f;
+			p[2] = 0xff;
+			continue;
+		}
+		p[1] = 0x40;
+		p[2] = 0x00;
+		p[3] = 0x10 | ((i / 7) & 0x0f);
+		memcpy(p + 4, "\x00\x00\xb0\x0d\x00\x01\xc1\x00\x00\x00\x01\xe1\x00", 13);
+		crc = dvb_crc32(p + 5, 12);
+		p[17] = crc >> 24;
+		p[18] = crc >> 16;
+		p[19] = crc >> 8;
+		p[20] = crc;
+	}
+	return ts;
+}
+
+/* local RTP replay source, runs in a child process */
+static void bench_replay(int port, uint8_t *ts, size_t len, int secs, int mbit)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	struct timespec t;
+	uint8_t dg[12 + 188 * 7];
+	size_t pos = 0;
+	int64_t budget = 0;
+	uint16_t seq = 0;
+	int sock, ticks;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (sock < 0 || connect(sock, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+		return;
+	memset(dg, 0, 12);
+	dg[0] = 0x80;
+	dg[1] = 33;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (ticks = 0; ticks < secs * 1000; ticks++) {
+		budget += mbit * 1000 / 8;
+		while (budget > 0) {
+			dg[2] = seq >> 8;
+			dg[3] = seq++;
+			memcpy(dg + 12, ts + pos, 188 * 7);
+			pos = (pos + 188 * 7) % len;
+			send(sock, dg, sizeof(dg), 0);
+			budget -= sizeof(dg);
+		}
+		t.tv_nsec += 1000000;
+		if (t.tv_nsec >= 1000000000) {
+			t.tv_nsec -= 1000000000;
+			t.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+	}
+	close(sock);
+}
+
+static int64_t rusage_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (int64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void bench_rx_run(int backend, uint8_t *ts, size_t len)
+{
+	static const char *name[] = { "recvmmsg", "io_uring" };
+	struct epoll_event evs[64];
+	struct evsrc *ev;
+	struct scantp *stp;
+	struct sockaddr sadr;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	uint64_t wakeups = 0;
+	int64_t start, cpu;
+	pid_t pid;
+	int i, n;
+
+	stp = calloc(1, sizeof(struct scantp));
+	if (!stp)
+		return;
+	epfd = epoll_create1(0);
+	rx_backend = backend;
+	if (epfd < 0 || rx_init() < 0 || rx_backend != backend)
+		goto out;
+
+	ts_info_init(&stp->tsi);
+	stp->tsi.stp = stp;
+	stp->tpi = calloc(1, sizeof(struct tp_info));
+	list_head_init(&stp->tpi->services);
+	stp->rtp_ev.handler = rtp_handler;
+	/* as after PLAY, datagrams of other states are dropped */
+	stp->scon.state = RTSP_RUNNING;
+	stp->tuned = 1;
+	stp->scon.usock = udpsock(&sadr, "0");
+	getsockname(stp->scon.usock, (struct sockaddr *) &sin, &slen);
+	fcntl(stp->scon.usock, F_SETFL, O_NONBLOCK);
+	rtp_sockopts(stp->scon.usock);
+	if (backend == RX_URING)
+		stp->urtp = uring_recv_start(stp, stp->scon.usock, 1);
+	else
+		ev_ctl(EPOLL_CTL_ADD, stp->scon.usock, &stp->rtp_ev, EPOLLIN);
+	add_sfilter(&stp->tsi, 0x00, 0x00, 0, 0, 60);
+	add_sfilter(&stp->tsi, 0x11, 0x42, 0, 1, 60);
+
+	pid = fork();
+	if (!pid) {
+		bench_replay(ntohs(sin.sin_port), ts, len, BENCH_SECS, BENCH_MBIT);
+		_exit(0);
+	}
+	cpu = rusage_us();
+	start = mtime_ms();
+	while (mtime_ms() < start + BENCH_SECS * 1000 + 500) {
+		n = epoll_wait(epfd, evs, 64, 100);
+		wakeups++;
+		for (i = 0; i < n; i++) {
+			ev = evs[i].data.ptr;
+			ev->handler(ev, evs[i].events);
+		}
+	}
+	cpu = rusage_us() - cpu;
+	waitpid(pid, NULL, 0);
+
+	printf("%-8s %9llu datagrams %6.1f Mbit/s %6u dropped %7.2f us CPU/datagram %6.1f datagrams/wakeup\n",
+	       name[backend], (unsigned long long) stp->rx_datagrams,
+	       stp->rx_datagrams * (12 + 188 * 7) * 8.0 / BENCH_SECS / 1e6,
+	       stp->rx_drops, stp->rx_datagrams ? (double) cpu / stp->rx_datagrams : 0.0,
+	       (double) stp->rx_datagrams / wakeups);
+
+	printf("%-8s %9u lost %9u reordered\n", "", stp->rseq.lost, stp->rseq.reordered);
+
+	uring_recv_stop(stp->urtp);
+	uring_drain();
+	close(stp->scon.usock);
+	ts_info_release(&stp->tsi);
+	free_tp_info(stp->tpi);
+	free(stp->rseq.win);
+out:
+	if (rx_backend != backend)
+		printf("%-8s not available\n", name[backend]);
+	close(epfd);
+	epfd = -1;
+	free(stp);
+}
+
+static void bench_rx(const char *file)
+{
+	uint8_t *ts;
+	size_t len;
+
+	ts = bench_load(file, &len);
+	if (!ts)
+		return;
+	printf("RTP replay at %d Mbit/s for %d s from %s\n",
+	       BENCH_MBIT, BENCH_SECS, file ? file : "synthetic mux");
+	bench_rx_run(RX_RECVMMSG, ts, len);
+	bench_rx_run(RX_URING, ts, len);
+	free(ts);
+}
+
+static int64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Demux a capture as a scan would: each pass starts a fresh ts_info
+ * with the PAT/SDT filters of a tune (EIT mode, so there is section
+ * work after the PMTs) and feeds the capture in 7 packet datagrams.
+ */
+static double bench_demux_run(uint8_t *ts, size_t len)
+{
+	struct scantp *stp;
+	uint64_t packets = 0;
+	int64_t start, t = 0;
+	size_t off;
+
+	stp = calloc(1, sizeof(struct scantp));
+	if (!stp)
+		return 0;
+	start = bench_ns();
+	do {
+		stp->tpi = calloc(1, sizeof(struct tp_info));
+		if (!stp->tpi)
+			break;
+		list_head_init(&stp->tpi->services);
+		stp->tpi->scan_eit = 1;
+		ts_info_init(&stp->tsi);
+		stp->tsi.stp = stp;
+		stp->tsi.now = mtime_ms();
+		add_sfilter(&stp->tsi, 0x00, 0x00, 0, 0, 60);
+		add_sfilter(&stp->tsi, 0x11, 0x42, 0, 1, 60);
+		for (off = 0; off < len; off += 188 * 7)
+			proc_tsps(&stp->tsi, ts + off, len - off < 188 * 7 ? len - off : 188 * 7);
+		packets += len / 188;
+		ts_info_release(&stp->tsi);
+		free_tp_info(stp->tpi);
+		t = bench_ns() - start;
+	} while (t < 2000000000LL);
+	free(stp);
+	return t ? packets * 1e9 / t : 0;
+}
+
+static void bench_demux(const char *file)
+{
+	uint8_t *ts;
+	size_t len;
+	double copy = 0, inplace = 0;
+	int fd, r;
+
+	ts = bench_load(file, &len);
+	if (!ts)
+		return;
+	printf("Demux of %zu packets from %s\n", len / 188, file ? file : "synthetic mux");
+	/* the scan diagnostics would dominate the timing */
+	fflush(stderr);
+	fd = dup(2);
+	if (!freopen("/dev/null", "w", stderr)) {
+		close(fd);
+		free(ts);
+		return;
+	}
+	for (r = 0; r < 3; r++) {
+		sec_inplace = 0;
+		copy += bench_demux_run(ts, len) / 3;
+		sec_inplace = 1;
+		inplace += bench_demux_run(ts, len) / 3;
+	}
+	fflush(stderr);
+	dup2(fd, 2);
+	close(fd);
+	printf("copy     %10.0f packets/s\n", copy);
+	printf("in place %10.0f packets/s (%+.1f%%)\n", inplace,
+	       copy ? (inplace / copy - 1) * 100 : 0.0);
+	free(ts);
+}
+
+/* CRC throughput of each implementation on section sized buffers */
+static void bench_crc(void)
+{
+	static const int sizes[] = { 188, 1024, 2048, 4096 };
+	struct crc_impl *ci;
+	uint8_t *buf;
+	int64_t start, t, bytes;
+	uint32_t sink = 0;
+	int i, j, n;
+
+	buf = malloc(64 * 4096);
+	if (!buf)
+		return;
+	for (i = 0; i < 64 * 4096; i++)
+		buf[i] = rand();
+	for (i = 0; i < sizeof(crc_impls) / sizeof(crc_impls[0]); i++) {
+		ci = &crc_impls[i];
+		if (i == 2 && !crc_clmul_ok()) {
+			printf("%-7s not supported by this CPU\n", ci->name);
+			continue;
+		}
+		printf("%-7s %s%s\n", ci->name, crc_check(ci) ? "MISMATCH" : "ok",
+		       ci->fn == crc_impl ? ", selected" : "");
+		for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			bytes = 0;
+			start = bench_ns();
+			do {
+				for (n = 0; n < 1024; n++)
+					sink += ci->fn(0xffffffff, buf + (n & 63) * 4096, sizes[j]);
+				bytes += 1024 * sizes[j];
+				t = bench_ns() - start;
+			} while (t < 300000000);
+			printf("        %4d byte sections: %6.2f GB/s\n", sizes[j],
+			       (double) bytes / t);
+		}
+	}
+	if (sink == 1)
+		printf("\n");
+	free(buf);
+}
+
+/* --bench=<name>[:<ts file>] */
+static int run_bench(char *arg)
+{
+	char *file = strchr(arg, ':');
+
+	if (file)
+		*file++ = 0;
+	if (!strcmp(arg, "rx"))
+		bench_rx(file);
+	else if (!strcmp(arg, "crc"))
+		bench_crc();
+	else if (!strcmp(arg, "demux"))
+		bench_demux(file);
+	else {
+		fprintf(stderr, "unknown benchmark %s\n", arg);
+		return -1;
+	}
+	return 0;
+}
+
 void usage() {
     printf("Octoscan"
            ", Copyright (C) 2016 Digital Devices GmbH\n\n");
-    printf("octoscan [options] <server ip>\n");
-    printf("    <server ip> address of SAT>IP server\n");
+    printf("octoscan [options] <server ip> [<server ip> ...]\n");
+    printf("    <server ip> address of SAT>IP server, <ip>/tcp for RTP over the\n");
+    printf("    RTSP connection (interleaved) instead of UDP, <ip>/http[:<port>]\n");
+    printf("    for HTTP streaming (default port 80)\n");
     printf("\n");
     printf("  options:\n");
     printf("    --use_nit, -n\n");
@@ -2187,6 +6031,27 @@ void usage() {
     printf("       Do an EIT scan\n");
     printf("    --eit_sid=<sid list>, -E <sid list>\n");
     printf("       sid list = comma separated list of sid numbers\n");
+    printf("    --tuners=<n>, -j <n>\n");
+    printf("       scan up to n transponders per server in parallel (default: 1)\n");
+    printf("    --rcvbuf=<kB>, -R <kB>\n");
+    printf("       UDP receive buffer size for RTP (default: 4096)\n");
+    printf("    --rx=<backend>, -r <backend>\n");
+    printf("       RTP receive backend = recvmmsg,uring (default: recvmmsg)\n");
+    printf("    --http_all, -H\n");
+    printf("       over HTTP ask for pids=all instead of a new request whenever PIDs are added\n");
+    printf("    --keep_session, -k\n");
+    printf("       retune one RTSP session per tuner instead of a new SETUP per transponder\n");
+    printf("    --lock_wait=<ms>, -L <ms>\n");
+    printf("       skip a transponder when RTCP reports no lock for this long (default: 1500, 0: off)\n");
+    printf("    --epg=<format>[:<file>], -X <format>[:<file>]\n");
+    printf("       with --eit, write events as they come in, format = xmltv,jsonl (default file: stdout)\n");
+    printf("    --epgdb=<file>, -Y <file>\n");
+    printf("       with --eit, write the events to an EPG database for epgquery\n");
+    printf("    --daemon[=<s>], -D[<s>]\n");
+    printf("       keep collecting EIT with --epg until stopped, moving on after s seconds\n");
+    printf("       on a transponder when others wait for a tuner (default: 300)\n");
+    printf("    --bench=<name>[:<ts file>], -B <name>[:<ts file>]\n");
+    printf("       run a benchmark instead of a scan, name = rx,crc,demux\n");
     printf("    --create, -c filename\n");
     printf("       creates M3U Playlist\n");
     printf("    --append, -a filename\n");
@@ -2202,9 +6067,11 @@ void usage() {
 int main(int argc, char **argv)
 {
     struct sigaction term;
-    struct scanip sip;
+    struct scanip *sips;
     struct tp_info tpi;
-    int i;
+    struct rusage ru;
+    char *bench = NULL;
+    int i, nsips, res;
 
     if (argc < 2) {
         usage();
@@ -2232,11 +6099,21 @@ int main(int argc, char **argv)
             {"append", required_argument, 0, 'a'},
             {"eit", no_argument, 0, 'e'},
             {"eit_sid", required_argument, 0, 'E'},
+            {"tuners", required_argument, 0, 'j'},
+            {"rcvbuf", required_argument, 0, 'R'},
+            {"rx", required_argument, 0, 'r'},
+            {"keep_session", no_argument, 0, 'k'},
+            {"http_all", no_argument, 0, 'H'},
+            {"lock_wait", required_argument, 0, 'L'},
+            {"epg", required_argument, 0, 'X'},
+            {"daemon", optional_argument, 0, 'D'},
+            {"epgdb", required_argument, 0, 'Y'},
+            {"bench", required_argument, 0, 'B'},
             {"help", no_argument, 0, '?'},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv,
-                        "nf:s:S:p:m:t:b:T:g:e:c:a:x:?",
+                        "nf:s:S:p:m:t:b:T:g:e:c:a:x:j:R:r:kHL:X:D::Y:B:?",
                         long_options, &option_index);
         if (c == -1)
             break;
@@ -2279,6 +6156,47 @@ int main(int argc, char **argv)
         case 'e':
             tpi.scan_eit = 1;
             break;
+        case 'j':
+            tuners = strtoul(optarg, NULL, 10);
+            if (tuners < 1)
+                tuners = 1;
+            break;
+        case 'R':
+            rtp_rcvbuf = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'r':
+            if (!strcmp(optarg, "uring"))
+                rx_backend = RX_URING;
+            else
+                rx_backend = RX_RECVMMSG;
+            break;
+        case 'k':
+            keep_session = 1;
+            break;
+        case 'H':
+            http_pids_all = 1;
+            break;
+        case 'L':
+            lock_wait = strtoul(optarg, NULL, 10);
+            break;
+        case 'X':
+            if (epg_open(optarg) < 0) {
+                fprintf(stderr, "Bad --epg=%s, use xmltv or jsonl[:<file>]\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'D':
+            daemon_dwell = optarg ? strtoul(optarg, NULL, 10) : 300;
+            if (daemon_dwell < 1)
+                daemon_dwell = 1;
+            tpi.scan_eit = 1;
+            break;
+        case 'Y':
+            epgdb_path = optarg;
+            break;
+        case 'B':
+            bench = optarg;
+            break;
         case 'f':
             tpi.freq = strtoul(optarg, NULL, 10);
             break;
@@ -2335,11 +6253,19 @@ int main(int argc, char **argv)
         }
     }
 
-    if (optind != argc - 1) {
+    crc_init();
+    if (bench)
+        return run_bench(bench) < 0 ? -1 : 0;
+
+    if (optind >= argc) {
         printf("wrong number of arguments\n\n");
         usage();
         exit(-1);
     }
+    if (daemon_dwell && !epg_fmt && !epgdb_path) {
+        fprintf(stderr, "--daemon needs --epg or --epgdb for its updates\n");
+        exit(-1);
+    }
 
     // Domyślne wartości dla DVB-T/DVB-T2, jeśli nie podano
     if (tpi.msys == 3 || tpi.msys == 16) { // DVB-T lub DVB-T2
@@ -2354,15 +6280,31 @@ int main(int argc, char **argv)
     term.sa_flags = 0;
 
     sigaction(SIGINT, &term, NULL);
+    sigaction(SIGTERM, &term, NULL);
 
-    scanip_init(&sip, argv[optind]);
-    add_tp(&sip, &tpi);
-    scanip(&sip);
-    scanip_release(&sip);
+    nsips = argc - optind;
+    sips = calloc(nsips, sizeof(struct scanip));
+    if (!sips)
+        exit(-1);
+    for (i = 0; i < nsips; i++) {
+        if (scanip_init(&sips[i], argv[optind + i]) < 0)
+            exit(-1);
+        add_tp(&sips[i], &tpi);
+    }
+    res = scanip(sips, nsips);
+    if (epgdb_path && epgdb_write(sips, nsips) < 0)
+        res = -1;
+    for (i = 0; i < nsips; i++)
+        scanip_release(&sips[i]);
+    free(sips);
+    epg_close();
 
     fprintf(stderr, "EIT Total size: %d Short size: %d\n", eit_size, eit_shortsize);
     fprintf(stderr, "    Services: %d Sections: %d Events: %d (%d deleted)\n",
             eit_services, eit_sections, eit_events - eit_events_deleted, eit_events_deleted);
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "    Event store: %d updated in place, %d allocations, peak RSS %ld kB\n",
+            eit_events_updated, eit_allocs, ru.ru_maxrss);
 
-    return 0;
+    return res;
 }